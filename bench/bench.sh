@@ -0,0 +1,49 @@
+#!/bin/sh
+# Runs every search mode over a corpus and reports timings as JSON.
+# Usage: bench/bench.sh SOLVER CORPUS_DIR [MODE...]
+# MODE is a search option without the dashes (default: queue stack astar bidirectional runs).
+# Prints a JSON array with one object per puzzle and mode: parse, search,
+# reconstruction and output times in ms, states expanded, states/sec, path length
+# (0 if unsolved) and peak RSS in KB, all taken from SOLVER --verbose.
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 SOLVER CORPUS_DIR [MODE...]" >&2
+    exit 1
+fi
+
+solver=$1
+corpus=$2
+shift 2
+modes=${*:-queue stack astar bidirectional runs}
+
+first=1
+echo "["
+for puzzle in "$corpus"/*; do
+    [ -f "$puzzle" ] || continue
+    for mode in $modes; do
+        stats=$("$solver" --"$mode" --verbose --output list "$puzzle" 2>&1 >/dev/null)
+        status=$?
+        [ $first -eq 1 ] || echo ","
+        first=0
+        printf '%s\n' "$stats" | awk -v puzzle="$puzzle" -v mode="$mode" -v status="$status" '
+            /^Parse time:/          { parse = $3 }
+            /^States expanded:/     { expanded = $3 }
+            /^Search time:/         { search = $3 }
+            /^Path length:/         { path = $3 }
+            /^Reconstruction time:/ { reconstruct = $3 }
+            /^Output time:/         { output = $3 }
+            /^Peak RSS:/            { rss = $3 }
+            END {
+                gsub(/["\\]/, "\\\\&", puzzle)
+                rate = search > 0 ? expanded / (search / 1000) : 0
+                printf "  {\"puzzle\": \"%s\", \"mode\": \"%s\", \"exit\": %d, \"solved\": %s, ",
+                       puzzle, mode, status, (path > 0 ? "true" : "false")
+                printf "\"parse_ms\": %.3f, \"search_ms\": %.3f, \"reconstruct_ms\": %.3f, \"output_ms\": %.3f, ",
+                       parse, search, reconstruct, output
+                printf "\"states_expanded\": %d, \"states_per_sec\": %.0f, \"path_length\": %d, \"peak_rss_kb\": %d}",
+                       expanded, rate, path, rss
+            }'
+    done
+done
+echo
+echo "]"
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Builds the standard benchmark corpus with genpuzzle.
+# Usage: bench/corpus.sh GENERATOR DIR
+# Writes small, medium and large puzzles, each solvable and unsolvable, into DIR.
+# The same generator binary always produces the same corpus.
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 GENERATOR DIR" >&2
+    exit 1
+fi
+
+gen=$1
+dir=$2
+mkdir -p "$dir" || exit 1
+
+# name colors height width walls doors traps
+while read -r name colors height width walls doors traps; do
+    for kind in solvable unsolvable; do
+        for seed in 1 2; do
+            "$gen" --colors "$colors" --height "$height" --width "$width" --walls "$walls" \
+                   --doors "$doors" --traps "$traps" --seed "$seed" --kind "$kind" \
+                   > "$dir/${name}_${kind}_${seed}.txt" || exit 1
+        done
+    done
+done <<TABLE
+small 3 64 64 0.25 0.05 4
+medium 5 512 512 0.25 0.02 32
+large 8 2000 2000 0.3 0.01 200
+open 2 2000 2000 0.05 0.001 0
+TABLE
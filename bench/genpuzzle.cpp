@@ -0,0 +1,215 @@
+// Random puzzle generator for benchmarks.
+// g++ -std=c++17 -O2 bench/genpuzzle.cpp -o genpuzzle
+// ./genpuzzle --colors 5 --height 2000 --width 2000 --walls 0.3 --doors 0.05 --traps 20 --kind solvable > big.txt
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <cstdint>
+#include <cstdlib>
+#include <getopt.h>
+using namespace std;
+
+enum class Kind {
+    kAny,        // whatever the dice say
+    kSolvable,   // a floor corridor always joins start and target
+    kUnsolvable  // the target is walled in on all four sides
+};
+
+struct GenOptions {
+    uint32_t num_colors = 3;
+    uint32_t height = 64;
+    uint32_t width = 64;
+    double walls = 0.2;   // chance a cell is '#'
+    double doors = 0.05;  // chance a cell is a button or a door (half each)
+    uint32_t traps = 0;   // number of '^' cells
+    uint64_t seed = 1;
+    Kind kind = Kind::kAny;
+};
+
+void printHelp(char *command) {
+    cout << "Usage: " << command << " {OPTIONS}\n";
+    cout << "Writes a random valid puzzle to stdout\n";
+    cout << "OPTIONS:\n";
+    cout << "-h, --help                   prints help message\n";
+    cout << "-c {N}, --colors {N}         number of colors, 0..26 (default 3)\n";
+    cout << "-H {N}, --height {N}         rows (default 64)\n";
+    cout << "-W {N}, --width {N}          columns (default 64)\n";
+    cout << "-w {P}, --walls {P}          wall density, 0..1 (default 0.2)\n";
+    cout << "-d {P}, --doors {P}          button/door density, 0..1 (default 0.05)\n";
+    cout << "-t {N}, --traps {N}          number of '^' cells (default 0)\n";
+    cout << "-s {N}, --seed {N}           random seed (default 1)\n";
+    cout << "-k {KIND}, --kind {KIND}     'any', 'solvable' or 'unsolvable' (default any)\n" << flush;
+}
+
+void fail(string const &message) {
+    cerr << "Error: " << message << "\n";
+    exit(1);
+}
+
+void getOptions(int argc, char *argv[], GenOptions &options) {
+    opterr = 0;
+    int choice;
+    int index = 0;
+    option long_options[] = {
+        {"help", no_argument, nullptr, 'h'},
+        {"colors", required_argument, nullptr, 'c'},
+        {"height", required_argument, nullptr, 'H'},
+        {"width", required_argument, nullptr, 'W'},
+        {"walls", required_argument, nullptr, 'w'},
+        {"doors", required_argument, nullptr, 'd'},
+        {"traps", required_argument, nullptr, 't'},
+        {"seed", required_argument, nullptr, 's'},
+        {"kind", required_argument, nullptr, 'k'},
+        {nullptr, 0, nullptr, '\0'},
+    };
+    auto number = [](char const *arg) {
+        char *end = nullptr;
+        unsigned long long value = strtoull(arg, &end, 10);
+        if (*arg == '\0' || *end != '\0' || *arg == '-') fail(string("not a number: ") + arg);
+        return static_cast<uint64_t>(value);
+    };
+    auto density = [](char const *arg) {
+        char *end = nullptr;
+        double value = strtod(arg, &end);
+        if (*arg == '\0' || *end != '\0' || !(value >= 0 && value <= 1)) fail(string("density must be in [0, 1]: ") + arg);
+        return value;
+    };
+
+    while ((choice = getopt_long(argc, argv, "hc:H:W:w:d:t:s:k:", long_options, &index)) != -1) {
+        switch (choice) {
+            case 'h':
+                printHelp(argv[0]);
+                exit(0);
+            case 'c':
+                options.num_colors = static_cast<uint32_t>(number(optarg));
+                break;
+            case 'H':
+                options.height = static_cast<uint32_t>(number(optarg));
+                break;
+            case 'W':
+                options.width = static_cast<uint32_t>(number(optarg));
+                break;
+            case 'w':
+                options.walls = density(optarg);
+                break;
+            case 'd':
+                options.doors = density(optarg);
+                break;
+            case 't':
+                options.traps = static_cast<uint32_t>(number(optarg));
+                break;
+            case 's':
+                options.seed = number(optarg);
+                break;
+            case 'k': {
+                string kind = optarg;
+                if (kind == "any") options.kind = Kind::kAny;
+                else if (kind == "solvable") options.kind = Kind::kSolvable;
+                else if (kind == "unsolvable") options.kind = Kind::kUnsolvable;
+                else fail("kind must be 'any', 'solvable' or 'unsolvable'");
+                break;
+            }
+            default:
+                fail("Unknown option");
+        }
+    }
+
+    if (options.num_colors > 26) fail("must have 0 <= colors <= 26");
+    if (options.height < 1 || options.width < 1) fail("height and width must be >= 1");
+    uint64_t cells = uint64_t{options.height} * options.width;
+    if (cells < 2 || (options.kind == Kind::kUnsolvable && cells < 3)) fail("map too small for a start and a target");
+    if (options.traps > cells - 2) fail("more traps than free cells");
+}
+
+int main(int argc, char *argv[]) {
+    ios_base::sync_with_stdio(false);
+    GenOptions options;
+    getOptions(argc, argv, options);
+
+    uint32_t height = options.height, width = options.width;
+    mt19937_64 rng(options.seed);
+    uniform_real_distribution<double> chance(0.0, 1.0);
+    auto pick = [&](uint64_t n) { return uniform_int_distribution<uint64_t>(0, n - 1)(rng); };
+
+// Random fill
+    vector<string> grid(height, string(width, '.'));
+    for (string &row : grid) {
+        for (char &c : row) {
+            double roll = chance(rng);
+            if (roll < options.walls) {
+                c = '#';
+            } else if (options.num_colors > 0 && roll < options.walls + options.doors) {
+                char letter = static_cast<char>('a' + pick(options.num_colors));
+                c = roll < options.walls + options.doors / 2 ? letter : static_cast<char>(letter - 'a' + 'A');
+            }
+        }
+    }
+
+// Start and target on distinct cells; for an unsolvable map never next to each other
+    uint64_t cells = uint64_t{height} * width;
+    uint64_t start = pick(cells), target = 0;
+    auto adjacent = [&](uint64_t a, uint64_t b) {
+        uint64_t ar = a / width, ac = a % width, br = b / width, bc = b % width;
+        return (ar == br && (ac + 1 == bc || bc + 1 == ac)) || (ac == bc && (ar + 1 == br || br + 1 == ar));
+    };
+    do {
+        target = pick(cells);
+    } while (target == start || (options.kind == Kind::kUnsolvable && adjacent(start, target)));
+    uint32_t sr = static_cast<uint32_t>(start / width), sc = static_cast<uint32_t>(start % width);
+    uint32_t tr = static_cast<uint32_t>(target / width), tc = static_cast<uint32_t>(target % width);
+
+    vector<bool> corridor(cells, false);
+    if (options.kind == Kind::kSolvable) {
+        // Floor is open in every color, so a monotone corridor of '.' is always walkable
+        uint32_t r = sr, c = sc;
+        while (r != tr || c != tc) {
+            bool row_step = r != tr && (c == tc || pick(2) == 0);
+            if (row_step) r = r < tr ? r + 1 : r - 1;
+            else c = c < tc ? c + 1 : c - 1;
+            grid[r][c] = '.';
+            corridor[uint64_t{r} * width + c] = true;
+        }
+    } else if (options.kind == Kind::kUnsolvable) {
+        if (tr > 0) grid[tr - 1][tc] = '#';
+        if (tr + 1 < height) grid[tr + 1][tc] = '#';
+        if (tc > 0) grid[tr][tc - 1] = '#';
+        if (tc + 1 < width) grid[tr][tc + 1] = '#';
+    }
+    grid[sr][sc] = '@';
+    grid[tr][tc] = '?';
+
+// Traps go on cells that are not the start, the target or the corridor's floor
+    vector<uint64_t> free_cells;
+    for (uint64_t cell = 0; cell < cells; ++cell) {
+        char c = grid[cell / width][cell % width];
+        if (c != '@' && c != '?' && !corridor[cell]) {
+            free_cells.push_back(cell);
+        }
+    }
+    if (options.kind == Kind::kUnsolvable) {
+        // Keep the target's walls
+        vector<uint64_t> keep;
+        for (uint64_t cell : free_cells) {
+            if (!adjacent(cell, target)) keep.push_back(cell);
+        }
+        free_cells.swap(keep);
+    }
+    uint32_t traps = static_cast<uint32_t>(min<uint64_t>(options.traps, free_cells.size()));
+    for (uint32_t i = 0; i < traps; ++i) {
+        uint64_t j = i + pick(free_cells.size() - i);
+        swap(free_cells[i], free_cells[j]);
+        grid[free_cells[i] / width][free_cells[i] % width] = '^';
+    }
+
+    cout << options.num_colors << " " << height << " " << width << "\n";
+    cout << "// genpuzzle --colors " << options.num_colors << " --height " << height << " --width " << width
+         << " --walls " << options.walls << " --doors " << options.doors << " --traps " << options.traps
+         << " --seed " << options.seed << " --kind "
+         << (options.kind == Kind::kSolvable ? "solvable" : options.kind == Kind::kUnsolvable ? "unsolvable" : "any")
+         << "\n";
+    for (string const &row : grid) {
+        cout << row << "\n";
+    }
+}
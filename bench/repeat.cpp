@@ -0,0 +1,54 @@
+// Solves one puzzle many times in a single process with one Solver and reports the search
+// time, so small changes to a search kernel show through process start-up and page-cache noise.
+// g++ -std=c++17 -O2 -pthread bench/repeat.cpp solver.cpp -I. -o repeat
+// ./repeat big.txt queue 20
+
+#include "solver.h"
+
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+using namespace std;
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        cerr << "Usage: " << argv[0] << " PUZZLE MODE [RUNS]\n";
+        cerr << "MODE is queue, stack, astar, bidirectional or runs (default 10 runs)\n";
+        return 1;
+    }
+    PuzzleMap map;
+    string message;
+    if (readPuzzleFile(argv[1], map, message) != ParseError::kNone) {
+        cerr << message << "\n";
+        return 1;
+    }
+    string mode = argv[2];
+    SolveOptions options;
+    if (mode == "queue") options.search_mode = SearchMode::kQueue;
+    else if (mode == "stack") options.search_mode = SearchMode::kStack;
+    else if (mode == "astar") options.search_mode = SearchMode::kAStar;
+    else if (mode == "bidirectional") options.search_mode = SearchMode::kBidirectional;
+    else if (mode == "runs") options.search_mode = SearchMode::kRuns;
+    else {
+        cerr << "Error: unknown mode " << mode << "\n";
+        return 1;
+    }
+    int runs = argc > 3 ? atoi(argv[3]) : 10;
+    if (runs < 1) {
+        cerr << "Error: runs must be >= 1\n";
+        return 1;
+    }
+
+    Solver solver;
+    SolveResult result;
+    double best = 0, total = 0;
+    for (int run = 0; run < runs; ++run) {
+        solver.solve(map, options, result);
+        best = run == 0 ? result.search_ms : min(best, result.search_ms);
+        total += result.search_ms;
+    }
+    cout << "{\"puzzle\": \"" << argv[1] << "\", \"mode\": \"" << mode << "\", \"runs\": " << runs
+         << ", \"min_search_ms\": " << best << ", \"avg_search_ms\": " << total / runs
+         << ", \"expanded\": " << result.expanded << "}\n";
+}
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Thread scaling report for the parallel BFS.
+# Usage: bench/scaling.sh SOLVER PUZZLE [MAX_THREADS]
+# Runs SOLVER --queue --threads N for N = 1..MAX_THREADS (default: number of cores)
+# and prints the search time and speedup over one thread for each.
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 SOLVER PUZZLE [MAX_THREADS]" >&2
+    exit 1
+fi
+
+solver=$1
+puzzle=$2
+max_threads=${3:-$(nproc)}
+
+printf "%8s %12s %8s\n" threads search_ms speedup
+base=""
+n=1
+while [ "$n" -le "$max_threads" ]; do
+    ms=$("$solver" --queue --threads "$n" --verbose --output list < "$puzzle" 2>&1 >/dev/null |
+         sed -n 's/^Search time: \([0-9.]*\) ms.*/\1/p')
+    if [ -z "$ms" ]; then
+        echo "Error: no timing from $solver with $n threads" >&2
+        exit 1
+    fi
+    [ -z "$base" ] && base=$ms
+    awk -v n="$n" -v ms="$ms" -v base="$base" 'BEGIN { printf "%8d %12.1f %8.2f\n", n, ms, base / ms }'
+    n=$((n + 1))
+done
@@ -1,54 +1,185 @@
 // Identifier: A8A3A33EF075ACEF9B08F5B9845569ECCB423725
+// Command line front end over the solver library (solver.h)
+#include "solver.h"
+#include "worker_pool.h"
+
 #include <iostream>
 #include <string>
 #include <vector>
-#include <deque>
-#include <queue>
-#include <stack>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <sstream>
+#include <fstream>
+#include <filesystem>
 #include <getopt.h>
+#include <sys/resource.h>
 
 using namespace std;
 
 void printHelp(char *command) {
-    cout << "Usage: " << command << " {OPTIONS}\n";
+    cout << "Usage: " << command << " {OPTIONS} [FILE]\n";
+    cout << "       " << command << " convert [--to text|binary] [--planes] IN OUT\n";
+    cout << "Reads the puzzle from FILE (memory-mapped) or from stdin if no FILE is given; text and binary\n";
+    cout << "puzzles are both accepted\n";
     cout << "OPTIONS:\n";
     cout << "-h, --help                   prints help message";
     cout << "-q, --queue                  search container = queue, uses breadth first search\n";
     cout << "-s, --stack                  search container = stack, uses depth first search\n";
-    cout << "-o {TYPE}, --output {TYPE}   specifies output type, requires argument {TYPE} = 'map' or 'list'\n" << flush;
+    cout << "-a, --astar                  search container = priority queue, uses A* search (shortest path)\n";
+    cout << "-b, --bidirectional          search from start and target at once, meets in the middle (shortest path)\n";
+    cout << "-r, --runs                   breadth first search over whole runs of floor in a row instead of cells,\n";
+    cout << "                             fast on open maps (path not always shortest)\n";
+    cout << "-P, --portfolio[=MODES]      races several search modes on their own threads and keeps the first\n";
+    cout << "                             answer, cancelling the rest (instead of a search mode); MODES is a\n";
+    cout << "                             comma list of queue, stack, astar, bidirectional and runs\n";
+    cout << "                             (default queue,stack,astar); the winner is logged\n";
+    cout << "-t {N}, --threads {N}        with --queue, runs a level-synchronous BFS on N threads\n";
+    cout << "-V {STORE}, --visited {STORE} where visited states are kept: 'dense' (one array over every color\n";
+    cout << "                             layer), 'lazy' (pages allocated as the search reaches them), 'sparse'\n";
+    cout << "                             (hash table) or 'auto' (default, picked from the map's size and buttons)\n";
+    cout << "-M {SIZE}, --mem-limit {SIZE} with --queue, searches out of core in about SIZE bytes (suffix K, M\n";
+    cout << "                             or G): the backtrace and frontier go to files in $TMPDIR or /tmp\n";
+    cout << "-T {SECONDS}, --time-limit {SECONDS} stops the search after SECONDS (a fraction is fine) and\n";
+    cout << "                             exits with status 2; progress is shown on stderr every second\n";
+    cout << "-C {FILE}, --checkpoint {FILE} with --queue or --stack, saves the search to FILE when the time\n";
+    cout << "                             limit runs out and resumes from FILE if it exists, so repeated runs\n";
+    cout << "                             finish a long search in steps; FILE is removed once it's done\n";
+    cout << "-c {DIR}, --cache {DIR}      keeps finished results in DIR, keyed by the parsed map and the search\n";
+    cout << "                             mode, and prints a cached one without searching; not with --index,\n";
+    cout << "                             --edits or --portfolio\n";
+    cout << "-Z {SIZE}, --cache-size {SIZE} bounds the --cache directory to about SIZE bytes (suffix K, M or G,\n";
+    cout << "                             default 256M, 0 = no bound); the least recently used entries go first\n";
+    cout << "-p, --prune                  peels dead-end pockets off the map before searching; pays off on\n";
+    cout << "                             mazes with many dead ends and many color layers\n";
+    cout << "-B {SOURCE}, --batch {SOURCE} solves many puzzles: a directory, a list file of paths,\n";
+    cout << "                             a file of concatenated puzzles, or '-' for puzzles on stdin\n";
+    cout << "-j {N}, --jobs {N}           number of puzzles solved at once in batch mode (default: cores)\n";
+    cout << "-i {FILE}, --index {FILE}    builds a region index of the grid once, then answers each\n";
+    cout << "                             'start_row start_col target_row target_col' line of FILE with it\n";
+    cout << "                             (instead of a search mode; paths are valid but not always shortest)\n";
+    cout << "-e {FILE}, --edits {FILE}    solves the puzzle, then applies each 'row col char' line of FILE as\n";
+    cout << "                             a cell edit and prints the new result, repairing the last search\n";
+    cout << "                             instead of starting over ('@'/'?' move the start/target)\n";
+    cout << "-v, --verbose                prints parse, search, reconstruction and output times, states expanded\n";
+    cout << "                             and peak RSS to stderr\n";
+    cout << "-S, --stats[=FILE]           reports search internals (per-layer counts, peak container size,\n";
+    cout << "                             presses, timings) to stderr, or as JSON to FILE\n";
+    cout << "-o {TYPE}, --output {TYPE}   specifies output type, requires argument {TYPE} = 'map' or 'list',\n";
+    cout << "                             'moves' (start, then run-length encoded N/E/S/W moves and presses),\n";
+    cout << "                             'moves-binary' (the same as varints), or 'reach' (--index only:\n";
+    cout << "                             reachable/unreachable per query)\n" << flush;
 }
 
-enum class SearchMode {
-    kNone,
-    kQueue,
-    kStack,
-};
-
 enum class OutputType {
     kMap,
     kList,
+    kMoves,       // run-length encoded moves, built without the per-state path
+    kMovesBinary, // the same as varints
+    kReach, // --index: one reachable/unreachable line per query, no paths
 };
 
 struct PuzzleOptions {
-    SearchMode search_mode = SearchMode::kNone;
+    SolveOptions solve{SearchMode::kNone}; // search mode, --threads and --stats
     OutputType output_type = OutputType::kMap;
-    // string input_file; ????
+    bool verbose = false;
+    string batch_source;  // empty = one puzzle from stdin
+    unsigned jobs = max(1u, thread::hardware_concurrency());
+    string input_file;    // empty = read the puzzle from stdin
+    string stats_file;    // empty = --stats report goes to stderr as text
+    string index_queries; // empty = solve the puzzle's own '@' and '?' with a search mode
+    string edits;         // empty = solve the puzzle once as given
+    vector<SearchMode> portfolio; // empty = run the one search mode picked
+    string cache_dir;     // empty = no solution cache
+    uint64_t cache_bytes = uint64_t{256} << 20;
 };
 
+// --portfolio's comma list of mode names
+bool parsePortfolio(string const &list, vector<SearchMode> &modes) {
+    SearchMode const all[] = {SearchMode::kQueue, SearchMode::kStack, SearchMode::kAStar,
+                              SearchMode::kBidirectional, SearchMode::kRuns};
+    modes.clear();
+    size_t from = 0;
+    while (from <= list.size()) {
+        size_t to = min(list.find(',', from), list.size());
+        string name = list.substr(from, to - from);
+        auto found = find_if(begin(all), end(all), [&](SearchMode mode) { return name == searchModeName(mode); });
+        if (found == end(all) || find(modes.begin(), modes.end(), *found) != modes.end()) {
+            return false;
+        }
+        modes.push_back(*found);
+        from = to + 1;
+    }
+    return true;
+}
+
+// A byte count with an optional K, M or G suffix, for --mem-limit and --cache-size; false
+// if it isn't one or overflows
+bool parseSize(char const *text, uint64_t &bytes) {
+    char *end = nullptr;
+    unsigned long long count = strtoull(text, &end, 10);
+    string suffix{end};
+    uint64_t scale = suffix.empty() ? 1 : suffix == "K" ? uint64_t{1} << 10
+                   : suffix == "M" ? uint64_t{1} << 20 : suffix == "G" ? uint64_t{1} << 30 : 0;
+    if (!isdigit(static_cast<unsigned char>(*text)) || scale == 0 || count > UINT64_MAX / scale) {
+        return false;
+    }
+    bytes = count * scale;
+    return true;
+}
+
+// Only one search mode may be picked
+void setSearchMode(PuzzleOptions &options, SearchMode mode) {
+    if (options.solve.search_mode == SearchMode::kNone) {
+        options.solve.search_mode = mode;
+        return;
+    }
+    bool queue_and_stack = (options.solve.search_mode == SearchMode::kQueue || options.solve.search_mode == SearchMode::kStack) &&
+                           (mode == SearchMode::kQueue || mode == SearchMode::kStack);
+    if (queue_and_stack) {
+        cerr << "Error: Cannot specify both --queue and --stack\n";
+    } else {
+        cerr << "Error: Cannot specify more than one search mode\n";
+    }
+    exit(1);
+}
+
 void getOptions(int argc, char **argv, PuzzleOptions &options) {
 
     struct option long_options[] = {
             {"help", no_argument, nullptr, 'h'},
             {"queue", no_argument, nullptr, 'q'},
             {"stack", no_argument, nullptr, 's'},
+            {"astar", no_argument, nullptr, 'a'},
+            {"bidirectional", no_argument, nullptr, 'b'},
+            {"runs", no_argument, nullptr, 'r'},
+            {"threads", required_argument, nullptr, 't'},
+            {"batch", required_argument, nullptr, 'B'},
+            {"jobs", required_argument, nullptr, 'j'},
+            {"verbose", no_argument, nullptr, 'v'},
+            {"stats", optional_argument, nullptr, 'S'},
             {"output", required_argument, nullptr, 'o'},
+            {"visited", required_argument, nullptr, 'V'},
+            {"index", required_argument, nullptr, 'i'},
+            {"mem-limit", required_argument, nullptr, 'M'},
+            {"edits", required_argument, nullptr, 'e'},
+            {"portfolio", optional_argument, nullptr, 'P'},
+            {"prune", no_argument, nullptr, 'p'},
+            {"time-limit", required_argument, nullptr, 'T'},
+            {"checkpoint", required_argument, nullptr, 'C'},
+            {"cache", required_argument, nullptr, 'c'},
+            {"cache-size", required_argument, nullptr, 'Z'},
             { nullptr, 0, nullptr, '\0' }
         };
 
     int choice = 0;
     int option_index = 0;
 
-    while ((choice = getopt_long(argc, argv, "hqso:", long_options, &option_index)) != -1) {
+    while ((choice = getopt_long(argc, argv, "hqsabrP::pt:B:j:vo:S::i:V:M:e:T:C:c:Z:", long_options, &option_index)) != -1) {
         switch(choice) {
             
             case 'h':
@@ -56,19 +187,98 @@ void getOptions(int argc, char **argv, PuzzleOptions &options) {
                 exit(0);
 
             case 'q':
-                if (options.search_mode != SearchMode::kNone) { 
-                    cerr << "Error: Cannot specify both --queue and --stack\n";
+                setSearchMode(options, SearchMode::kQueue);
+                break;
+
+            case 's':
+                setSearchMode(options, SearchMode::kStack);
+                break;
+
+            case 'a':
+                setSearchMode(options, SearchMode::kAStar);
+                break;
+
+            case 'b':
+                setSearchMode(options, SearchMode::kBidirectional);
+                break;
+
+            case 'r':
+                setSearchMode(options, SearchMode::kRuns);
+                break;
+
+            case 'P':
+                if (!parsePortfolio(optarg ? optarg : "queue,stack,astar", options.portfolio)) {
+                    cerr << "Error: --portfolio takes distinct modes from queue, stack, astar, bidirectional\n"
+                         << "and runs, separated by commas\n";
                     exit(1);
                 }
-                options.search_mode = SearchMode::kQueue;
                 break;
 
-            case 's':
-                if(options.search_mode != SearchMode::kNone) {
-                    cerr << "Error: Cannot specify both --queue and --stack\n";
+            case 't': {
+                char *end = nullptr;
+                unsigned long threads = strtoul(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || threads < 1 || threads > 1024) {
+                    cerr << "Error: --threads must be a number from 1 to 1024\n";
                     exit(1);
                 }
-                options.search_mode = SearchMode::kStack;
+                options.solve.threads = static_cast<unsigned>(threads);
+                break;
+            }
+
+            case 'p':
+                options.solve.prune = true;
+                break;
+
+            case 'T': {
+                char *end = nullptr;
+                double seconds = strtod(optarg, &end);
+                if (*optarg == '\0' || *end != '\0' || !(seconds > 0 && seconds < 1e9)) {
+                    cerr << "Error: --time-limit must be a positive number of seconds\n";
+                    exit(1);
+                }
+                options.solve.time_limit = seconds;
+                break;
+            }
+
+            case 'C':
+                options.solve.checkpoint = optarg;
+                break;
+
+            case 'c':
+                options.cache_dir = optarg;
+                break;
+
+            case 'Z':
+                if (!parseSize(optarg, options.cache_bytes)) {
+                    cerr << "Error: --cache-size must be a number of bytes, optionally with K, M or G\n";
+                    exit(1);
+                }
+                break;
+
+            case 'B':
+                options.batch_source = optarg;
+                break;
+
+            case 'j': {
+                char *end = nullptr;
+                unsigned long jobs = strtoul(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || jobs < 1 || jobs > 1024) {
+                    cerr << "Error: --jobs must be a number from 1 to 1024\n";
+                    exit(1);
+                }
+                options.jobs = static_cast<unsigned>(jobs);
+                break;
+            }
+
+            case 'v':
+                options.verbose = true;
+                break;
+
+            case 'S':
+                options.solve.stats = true;
+                if (optarg) {
+                    options.stats_file = optarg;
+                }
                 break;
 
             case 'o': { // Need a block here to declare a variable inside a case
@@ -77,523 +287,758 @@ void getOptions(int argc, char **argv, PuzzleOptions &options) {
                     options.output_type = OutputType::kMap;
                 } else if (output_arg == "list") {
                     options.output_type = OutputType::kList;
+                } else if (output_arg == "moves") {
+                    options.output_type = OutputType::kMoves;
+                } else if (output_arg == "moves-binary") {
+                    options.output_type = OutputType::kMovesBinary;
+                } else if (output_arg == "reach") {
+                    options.output_type = OutputType::kReach;
                 } else {
-                    cerr << "Error: --output must be 'map' or 'list'\n";
+                    cerr << "Error: --output must be 'map', 'list', 'moves', 'moves-binary' or 'reach'\n";
                     exit(1);
                 }
                 break;
             }
 
+            case 'i':
+                options.index_queries = optarg;
+                break;
+
+            case 'e':
+                options.edits = optarg;
+                break;
+
+            case 'V': {
+                string store{optarg};
+                if (store == "auto") {
+                    options.solve.visited = VisitedStore::kAuto;
+                } else if (store == "dense") {
+                    options.solve.visited = VisitedStore::kDense;
+                } else if (store == "lazy") {
+                    options.solve.visited = VisitedStore::kLazy;
+                } else if (store == "sparse") {
+                    options.solve.visited = VisitedStore::kSparse;
+                } else {
+                    cerr << "Error: --visited must be 'auto', 'dense', 'lazy' or 'sparse'\n";
+                    exit(1);
+                }
+                break;
+            }
+
+            case 'M':
+                if (!parseSize(optarg, options.solve.mem_limit) || options.solve.mem_limit == 0) {
+                    cerr << "Error: --mem-limit must be a positive number of bytes, optionally with K, M or G\n";
+                    exit(1);
+                }
+                break;
+
             default:
                 cerr << "Error: invalid option\n" << flush;
                 exit(1);
         }
     }
-// if(optind < argc) { options.input_file = argv[optind]; }
-    if (options.search_mode == SearchMode::kNone) {
-        cerr << "Error: no search mode specified\n" << flush;
+    if (optind < argc) { options.input_file = argv[optind]; }
+    bool const stoppable = options.solve.time_limit != 0 || !options.solve.checkpoint.empty();
+    if (stoppable && (!options.index_queries.empty() || !options.edits.empty() || options.solve.threads != 0 ||
+                      options.solve.mem_limit != 0)) {
+        cerr << "Error: --time-limit and --checkpoint can't be combined with --index, --edits, --threads\n"
+             << "or --mem-limit\n" << flush;
         exit(1);
     }
-}
-
-
-uint32_t charToNum(char c) { 
-    if (c == '^') return 0;
-    if (isupper(c)) return static_cast<uint32_t>(c - 'A' + 1);
-    if (islower(c)) {
-        uint32_t num = static_cast<uint32_t>(c - 'a' + 1);
-        if (num > 26) {  // Safety check
-            cerr << "Invalid color character: '" << c << "'\n";
+    if (!options.solve.checkpoint.empty() &&
+        (options.solve.time_limit == 0 || !options.portfolio.empty() || !options.batch_source.empty() ||
+         (options.solve.search_mode != SearchMode::kQueue && options.solve.search_mode != SearchMode::kStack))) {
+        cerr << "Error: --checkpoint needs --time-limit and --queue or --stack, without --portfolio or --batch\n"
+             << flush;
+        exit(1);
+    }
+    if (!options.cache_dir.empty() &&
+        (!options.index_queries.empty() || !options.edits.empty() || !options.portfolio.empty())) {
+        cerr << "Error: --cache can't be combined with --index, --edits or --portfolio\n" << flush;
+        exit(1);
+    }
+    if (!options.index_queries.empty()) {
+        if (options.solve.search_mode != SearchMode::kNone || !options.portfolio.empty() ||
+            options.solve.threads != 0 || !options.batch_source.empty() || options.solve.stats ||
+            !options.edits.empty()) {
+            cerr << "Error: --index can't be combined with a search mode, --portfolio, --threads, --batch, --stats\n"
+                 << "or --edits\n"
+                 << flush;
             exit(1);
         }
-        return num;
+        return;
     }
-    cerr << "Invalid color character: '" << c << "'\n";
-    exit(1);
-}
-
-char numToChar(uint32_t num) {
-    if (num == 0) return '^';
-    if (num >= 1 && num <= 26) return 'a' + static_cast<char>(num - 1);
-    if (num == 27) return 'z';
-    cerr <<"Invalid number " << num << " \n"; 
-    exit(1);
-}
-
-
-
-struct Coord {
-    uint32_t color;
-    uint32_t row;
-    uint32_t column;
-
-    // Initializer
-     Coord(uint32_t c, uint32_t r, uint32_t cl) : color(c), row(r), column(cl) {};
-
-};
-
-struct PuzzleMap {
-    uint32_t num_colors = 0;
-    uint32_t height = 0;
-    uint32_t width = 0;
-
-    vector<vector<char>> grid;
-    Coord start{charToNum('^'),0,0}, target{charToNum('^'),0,0}; // Used {} to initialize bc I'm initializing in a struct!
-};
-
-bool isValidChar(char c, uint32_t num_colors) {
-    if (c == '@' || c == '#' || c == '^' || c == '.' || c == '?') {
-        return true;
-    } else if (isupper(c)) { 
-        return (static_cast<uint32_t>(c-'A') <= (num_colors));
-    } else if (islower(c)) {
-        return (static_cast<uint32_t>(c-'a') <= (num_colors));
-    } else {return false;}
-}
-
-
-PuzzleMap readInput() {
-
-// Reading in map parameters
-    PuzzleMap map;
-    if(!(cin >> map.num_colors >> map.height >> map.width)) {
-        cerr << "Error: must specify num_colors, height, width!\n";
+    if (!options.edits.empty()) {
+        if (options.solve.search_mode != SearchMode::kNone || !options.portfolio.empty() ||
+            options.solve.threads != 0 || !options.batch_source.empty() || options.solve.stats ||
+            options.solve.mem_limit != 0 || options.output_type == OutputType::kReach) {
+            cerr << "Error: --edits can't be combined with a search mode, --portfolio, --threads, --batch, --stats,\n"
+                 << "--mem-limit or --output reach\n" << flush;
+            exit(1);
+        }
+        return;
+    }
+    if (options.output_type == OutputType::kReach) {
+        cerr << "Error: --output reach only works with --index\n" << flush;
+        exit(1);
+    }
+    if (options.output_type == OutputType::kMoves || options.output_type == OutputType::kMovesBinary) {
+        options.solve.path_format = PathFormat::kMoves;
+    }
+    if (!options.portfolio.empty()) {
+        if (options.solve.search_mode != SearchMode::kNone || options.solve.threads != 0 ||
+            options.solve.mem_limit != 0) {
+            cerr << "Error: --portfolio can't be combined with a search mode, --threads or --mem-limit\n" << flush;
+            exit(1);
+        }
+        return;
+    }
+    if (options.solve.search_mode == SearchMode::kNone) {
+        cerr << "Error: no search mode specified\n" << flush;
         exit(1);
     }
-// Checking valid map parameters
-    if (!(map.num_colors <= 26)) {
-        cerr << "Error: must have 0 <= num_colors <= 26\n";
+    if (options.solve.threads != 0 && options.solve.search_mode != SearchMode::kQueue) {
+        cerr << "Error: --threads only works with --queue\n" << flush;
         exit(1);
     }
-    if (map.height < 1 || map.width < 1) {
-        cerr << "Error: height and width must be >= 1\n";
+    if (options.solve.threads != 0 && options.solve.visited != VisitedStore::kAuto &&
+        options.solve.visited != VisitedStore::kDense) {
+        cerr << "Error: --threads needs --visited dense\n" << flush;
         exit(1);
     }
-// Resizing
-    map.grid.resize(map.height, vector<char>(map.width, '.'));
-
-// Ignoring comments
-    string junk;
-    while(getline(cin, junk)) {
-        if ((junk.substr(0, 2) == "//") || junk.empty()) {
-            continue; 
-        } else {break;}
-    }
-// Track number of starts and targets read
-uint32_t num_starts =0, num_targets =0;
-string line = junk;
-
-// For each row/line
-    for(uint32_t i=0; i < map.height; ++i) {
-// For each char in line
-        for (uint32_t j = 0; j < map.width; ++j) {
-            char c = line[j];
-
-// Check valid character and add to map
-            if (!isValidChar(c, map.num_colors)) {
-                cerr << "Error: Invalid char '" << c 
-                          << "' in line " << line << "\n";
-                exit(1);
-            } else {map.grid[i][j] = c;}
-
-// Track start/target
-            if (c == '@') {
-                map.start = Coord(charToNum('^'),i,j);
-                num_starts++;
-            } else if (c == '?') {
-                map.target = Coord(charToNum('^'),i,j);
-                num_targets++;
-            }
-        }
-// Get the next line
-        getline(cin, line);
+    if (options.solve.mem_limit != 0 && (options.solve.search_mode != SearchMode::kQueue ||
+                                         options.solve.threads != 0 ||
+                                         options.solve.visited != VisitedStore::kAuto)) {
+        cerr << "Error: --mem-limit only works with --queue, without --threads or --visited\n" << flush;
+        exit(1);
     }
-
-// Validate start/target counts at the end
-    if (num_starts != 1 || num_targets != 1) {
-        cerr << "Error: Missing/excess '@' or '?'\n";
+    if (options.solve.threads != 0 && !options.batch_source.empty()) {
+        cerr << "Error: --threads can't be combined with --batch, use --jobs\n" << flush;
         exit(1);
     }
-    return map;
 }
 
 
+// Milliseconds since start, for the --verbose timings
+double elapsedMs(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
 
+// Largest resident set so far, in KB (Linux reports ru_maxrss in KB)
+long peakRssKb() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
 
+// Prints a solved or unsolved result in the requested output type
+void printResult(PuzzleMap const &map, SolveResult const &result, PuzzleOptions const &options, ostream &out) {
+    if (result.status == SolveStatus::kSolved) {
+        if (options.output_type == OutputType::kList) {
+            generateListOutput(map, result, out);
+        }
+        else if (options.output_type == OutputType::kMoves || options.output_type == OutputType::kMovesBinary) {
+            generateMovesOutput(map, result, options.output_type == OutputType::kMovesBinary, out);
+        }
+        else if (options.output_type == OutputType::kMap) {
+            // Big maps render their layers in parallel, except in a batch where the jobs already fill the cores
+            unsigned render_threads = !options.batch_source.empty() ? 1
+                : options.solve.threads != 0 ? options.solve.threads : thread::hardware_concurrency();
+            generateMapOutput(map, result, render_threads, out);
+        }
+    } 
+    else {
+        printNoSolutionOutput(map, result, out);
+    }
+}
 
+// --cache: the directory is made up front so a bad path is reported before any solving;
+// null without --cache
+unique_ptr<SolutionCache> openCache(PuzzleOptions const &options) {
+    if (options.cache_dir.empty()) {
+        return nullptr;
+    }
+    error_code ec;
+    filesystem::create_directories(options.cache_dir, ec);
+    if (!filesystem::is_directory(options.cache_dir, ec)) {
+        cerr << "Error: cannot use cache directory " << options.cache_dir << "\n";
+        exit(1);
+    }
+    return make_unique<SolutionCache>(options.cache_dir, options.cache_bytes);
+}
 
+// The cache counters for a whole --batch, with --verbose
+void printCacheCounters(SolutionCache const *cache, ostream &log) {
+    if (cache) {
+        log << "Cache: " << cache->hits() << " hits, " << cache->misses() << " misses, " << cache->evicted()
+            << " evicted\n";
+    }
+}
 
+// Solves one puzzle with the CLI's options and prints its output (and --verbose lines to
+// log). A result found in cache skips the search; a new one is stored there. Returns the
+// time spent writing the output, for --stats.
+double solvePuzzle(Solver &solver, SolutionCache *cache, SolveResult &result, PuzzleMap const &map,
+                   PuzzleOptions const &options, ostream &out, ostream &log) {
+    bool const cached = cache && cache->lookup(map, options.solve, result);
+    SolveStatus status = cached ? result.status
+                       : options.portfolio.empty() ? solver.solve(map, options.solve, result)
+                                                   : solvePortfolio(map, options.portfolio, options.solve, result);
+    if (status == SolveStatus::kSpillFailed) {
+        // A batch reports it in the puzzle's record like any other error
+        (options.batch_source.empty() ? log : out) << "Error: cannot use spill files for --mem-limit\n";
+        return 0;
+    }
+    if (status == SolveStatus::kCheckpointFailed) {
+        log << "Error: cannot use checkpoint " << options.solve.checkpoint
+            << " (unreadable, or saved from another map or options)\n";
+        return 0;
+    }
+    if (status == SolveStatus::kTimedOut) {
+        (options.batch_source.empty() ? log : out) << "Time limit reached after " << result.expanded
+                                                   << " states expanded"
+                                                   << (options.solve.checkpoint.empty() ? "" : ", checkpoint saved")
+                                                   << "\n";
+        return 0;
+    }
+    if (!options.portfolio.empty()) {
+        log << "Portfolio winner: " << searchModeName(result.search_mode) << "\n";
+    }
+    if (cache && !cached) {
+        cache->store(map, options.solve, result);
+    }
 
+    if (options.verbose) {
+        if (cache) {
+            log << "Cache: " << (cached ? "hit" : "miss") << "\n";
+        }
+        log << "States expanded: " << result.expanded << "\n";
+        log << "Search time: " << result.search_ms << " ms";
+        if (options.solve.threads != 0) {
+            log << " (" << options.solve.threads << " threads)";
+        }
+        log << "\n";
+        char const *const store_names[] = {"auto", "dense", "lazy", "sparse", "striped"};
+        log << "Visited store: " << store_names[static_cast<int>(result.visited)] << ", "
+            << (result.visited_bytes + 1023) / 1024 << " KB\n";
+        log << "Pruned cells: " << result.pruned_cells << "\n";
+        if (result.status == SolveStatus::kSolved) {
+            log << "Path length: " << result.pathLength() << "\n";
+            log << "Reconstruction time: " << result.reconstruct_ms << " ms\n";
+        }
+    }
 
+    auto output_start = chrono::steady_clock::now();
+    printResult(map, result, options, out);
+    double output_ms = elapsedMs(output_start);
+    if (options.verbose) {
+        log << "Output time: " << output_ms << " ms\n";
+    }
+    return output_ms;
+}
 
+// --stats report as text, for stderr
+void writeStatsText(SolveResult const &result, PuzzleMap const &map, double parse_ms, double output_ms,
+                    ostream &log) {
+    SearchStats const &stats = result.stats;
+    log << "Stats:\n";
+    log << "  Search mode: " << searchModeName(result.search_mode) << "\n";
+    log << "  Parse time: " << parse_ms << " ms\n";
+    log << "  Search time: " << result.search_ms << " ms\n";
+    log << "  Reconstruction time: " << result.reconstruct_ms << " ms\n";
+    log << "  Output time: " << output_ms << " ms\n";
+    log << "  Path length: " << result.pathLength() << "\n";
+    log << "  Peak container size: " << stats.peak_container << "\n";
+    log << "  Button presses: " << stats.presses << " explored, " << stats.path_presses << " on path\n";
+    log << "  Trap activations: " << stats.trap_presses << " explored, " << stats.path_trap_presses << " on path\n";
+    for (uint32_t color = 0; color <= map.num_colors; ++color) {
+        log << "  Layer " << numToChar(color) << ": " << stats.discovered[color] << " discovered, "
+            << stats.expanded[color] << " expanded\n";
+    }
+}
 
+// --stats report as one JSON object
+void writeStatsJson(SolveResult const &result, PuzzleMap const &map, double parse_ms, double output_ms,
+                    string const &name, ostream &out) {
+    SearchStats const &stats = result.stats;
+    string escaped;
+    for (char c : name) {
+        if (c == '"' || c == '\\') escaped += '\\';
+        escaped += c;
+    }
+    out << "{\"puzzle\": \"" << escaped << "\", \"search_mode\": \"" << searchModeName(result.search_mode)
+        << "\", \"parse_ms\": " << parse_ms
+        << ", \"search_ms\": " << result.search_ms << ", \"reconstruct_ms\": " << result.reconstruct_ms
+        << ", \"output_ms\": " << output_ms << ", \"path_length\": " << result.pathLength()
+        << ", \"peak_container\": " << stats.peak_container << ", \"presses\": " << stats.presses
+        << ", \"trap_presses\": " << stats.trap_presses << ", \"path_presses\": " << stats.path_presses
+        << ", \"path_trap_presses\": " << stats.path_trap_presses << ", \"layers\": [";
+    for (uint32_t color = 0; color <= map.num_colors; ++color) {
+        out << (color ? ", " : "") << "{\"color\": \"" << numToChar(color) << "\", \"discovered\": "
+            << stats.discovered[color] << ", \"expanded\": " << stats.expanded[color] << "}";
+    }
+    out << "]}";
+}
 
 
 
+// One puzzle in a batch: a file to read, or text already split out of a stream
+struct BatchItem {
+    string name;
+    string path; // empty if text holds the puzzle
+    string text;
+};
 
-
-// Initialize a bactrace map
-vector<vector<vector<char>>> createBacktraceMap (PuzzleMap const & map) {
-    vector<vector<vector<char>>> backtrace (map.num_colors + 1, // vector contains number of grids
-                vector<vector<char>>(map.height,  // vector contains number of rows
-                vector<char>(map.width, '-'))); // charatcers in each row-vector preset to '-'
-
-    
-    return backtrace;
+// "num_colors height width" on a line by itself, how a puzzle file starts
+bool looksLikeHeader(string const &line) {
+    istringstream fields(line);
+    uint64_t value = 0;
+    int count = 0;
+    while (fields >> value) {
+        ++count;
+    }
+    return count == 3 && fields.eof();
 }
 
+// Map rows never contain digits, so in a stream of puzzles any line starting with one is
+// the next puzzle's header (even a broken one, which then gets its own error record)
+bool startsPuzzle(string const &line) {
+    size_t first = line.find_first_not_of(" \t\r");
+    return first != string::npos && isdigit(static_cast<unsigned char>(line[first]));
+}
 
+bool isBlankOrComment(string const &line) {
+    size_t first = line.find_first_not_of(" \t\r");
+    return first == string::npos || line.compare(first, 2, "//") == 0;
+}
 
-
-
-void generateListOutput(Coord target_state, vector<vector<vector<char>>> const &bt) {
-    stack<Coord> path;
-    Coord current = target_state;
-    path.push(current);
-// While not start, look at marker in the backtrace
-    while (bt[current.color][current.row][current.column] != '@') {
-        char marker = bt[current.color][current.row][current.column];
-        if (islower(marker) || marker == '^') {
-            current = Coord{charToNum(marker), current.row, current.column};
-        } else {
-            switch (marker) {
-                case 'N': current = Coord{current.color, current.row - 1, current.column}; break;
-                case 'E': current = Coord{current.color, current.row, current.column + 1}; break;
-                case 'S': current = Coord{current.color, current.row + 1, current.column}; break;
-                case 'W': current = Coord{current.color, current.row, current.column - 1}; break;
-                default:
-                    cerr << "Error: Invalid path marker\n";
-                    exit(1);
-            }
+// Cuts a stream of back-to-back puzzles at each header line. Stray text before the first
+// header becomes its own item so it gets reported instead of silently dropped.
+void splitPuzzleStream(istream &in, string const &name, vector<BatchItem> &items) {
+    string line, text;
+    bool started = false;
+    size_t count = 0;
+    auto flush = [&] {
+        if (started || !text.empty()) {
+            items.push_back(BatchItem{name + ":" + to_string(++count), "", text});
         }
-
-        path.push(current);
-    }
-
-    // Print path from start to goal
-    while (!path.empty()) {
-        Coord c = path.top();
-        path.pop();
-        cout << "(" << numToChar(c.color) << ", (" << c.row << ", " << c.column << "))\n";
+        text.clear();
+    };
+    while (getline(in, line)) {
+        if (startsPuzzle(line)) {
+            flush();
+            started = true;
+        } else if (!started && isBlankOrComment(line)) {
+            continue;
+        }
+        text += line;
+        text += '\n';
     }
+    flush();
 }
 
-void generateMapOutput(PuzzleMap const &map, Coord const &solution_state, 
-                      vector<vector<vector<char>>> const &btrace) {
-// Path reconstruction 
-    stack<Coord> path;
-    Coord current = solution_state;
-    path.push(current);
-
-    while (btrace[current.color][current.row][current.column] != '@') {
-    // Get marker from backtrace
-        char marker = btrace[current.color][current.row][current.column];
-        
-    // Change color if marker = button
-        if (islower(marker) || marker == '^') {
-            current = Coord{charToNum(marker), current.row, current.column};
-        } else {
-    // Move if marker = direction
-            switch (marker) {
-                case 'N': current = Coord{current.color, current.row - 1, current.column}; break;
-                case 'S': current = Coord{current.color, current.row + 1, current.column}; break;
-                case 'E': current = Coord{current.color, current.row, current.column + 1}; break;
-                case 'W': current = Coord{current.color, current.row, current.column - 1}; break;
-                default:
-                    cerr << "Error: Invalid path marker\n";
-                    exit(1);
+// A batch source is a directory (every regular file in it, by name), a stream of
+// concatenated puzzles (a file whose first real line is a header, or "-" for stdin),
+// or a list file with one puzzle path per line.
+vector<BatchItem> collectBatch(string const &source) {
+    vector<BatchItem> items;
+    if (source == "-") {
+        splitPuzzleStream(cin, "stdin", items);
+        return items;
+    }
+    error_code ec;
+    if (filesystem::is_directory(source, ec)) {
+        vector<string> paths;
+        for (auto const &entry : filesystem::directory_iterator(source, ec)) {
+            if (entry.is_regular_file()) {
+                paths.push_back(entry.path().string());
             }
         }
-        path.push(current);
+        sort(paths.begin(), paths.end());
+        for (string const &path : paths) {
+            items.push_back(BatchItem{path, path, ""});
+        }
+        return items;
     }
 
-// 2 3D vectors filled with FALSE
-    vector<vector<vector<bool>>> is_on_path(
-        map.num_colors + 1, 
-        vector<vector<bool>>(map.height, 
-        vector<bool>(map.width, false)));
-
-
-// While loop to fill is_on_path
-    while (!path.empty()) {
-        Coord c = path.top();
-        path.pop();
-        is_on_path[c.color][c.row][c.column] = true;
+    ifstream in(source);
+    if (!in) {
+        cerr << "Error: cannot read batch source " << source << "\n";
+        exit(1);
     }
-
-// Generate each color map
-    for (uint32_t color = 0; color <= map.num_colors; ++color) {
-        cout << "// color " << numToChar(color) << "\n";
-        for (uint32_t row = 0; row < map.height; ++row) {
-            for (uint32_t col = 0; col < map.width; ++col) {
-                char original = map.grid[row][col];
-                char output = original;
-            // If map coord on solution path, mark '+' or smth
-                if (is_on_path[color][row][col]) {
-                    if(original == '@' && color != 0) {output = '+';}
-                    if (original == '.' || (original == toupper(numToChar(color)) && original != '^')) {
-                        output = '+';
-                // If button
-                    } else if (islower(original)) {
-                        //if color of current color map = button color  AND  backtrace is marked with a button
-                        if (color == charToNum(original)) {
-                            // if button character is different from backtrace character at same color,row,column, then @
-                            if (btrace[color][row][col] != original) {
-                                output = '@';
-                            } else {output = '+';} // otherwise if button character N,S,E,W, then +
-                            
-                        } else {
-                            output = '%';
-                        }
-                    }
-                    // Keep @ for start (only on color ^)
-                    if (original == '@' && color == 0) {
-                        output = '@';//
-                    }
-                    // Always show target
-                    if (original == '?') {
-                        output = '?';
-                    }
-            /////////////////////////////////////
-                // handle trapped buttons
-                    if (original == '^') {
-                        if (color == charToNum('^')) {
-                            // Only show @ if actually pressed the trap
-                            if (islower(btrace[color][row][col])) {
-                                output = '@';
-                            } else {
-                                output = '+';
-                            }
-
-                        } else {
-                            output = '%';
-                        }
-                    }
-            //////////////////////////////////////
-                }
-                else {
-                        if(original == '@' && color != 0) {output = '@';}
-                    // Not on solution path - replace buttons and doors with '.'
-                        if ((islower(original) || original == '^') && charToNum(original) == color) {
-                            output = '.';
-                        } else if (isupper(original) && charToNum(original) == color) {
-                            output = '.';
-                        } else if(original == '@') {
-                            output = '.';
-                        }
-                }
-                cout << output;
-            }
-            cout << "\n";
+    string line;
+    while (getline(in, line) && isBlankOrComment(line)) {
+    }
+    in.clear();
+    in.seekg(0);
+    if (looksLikeHeader(line)) {
+        splitPuzzleStream(in, source, items);
+        return items;
+    }
+    while (getline(in, line)) {
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == string::npos) {
+            continue;
         }
+        string path = line.substr(first, line.find_last_not_of(" \t\r") - first + 1);
+        items.push_back(BatchItem{path, path, ""});
     }
+    return items;
 }
 
-
-
-void printNoSolutionOutput(const PuzzleMap& map, const vector<vector<vector<char>>>& btrace) {
-    cout << "No solution.\n";
-    cout << "Discovered:\n";
-    
-    // Print the map with undiscovered locations as '#'
-    for (uint32_t row = 0; row < map.height; ++row) {
-        for (uint32_t col = 0; col < map.width; ++col) {
-            bool discovered = false;
-            
-            // Check if this location was discovered in any color
-            for (uint32_t color = 0; color < btrace.size(); ++color) {
-                if (btrace[color][row][col] != '-') {
-                    discovered = true;
-                    break;
+// Solves every puzzle in the batch on a pool of options.jobs workers. Each puzzle's output
+// is written as one record ("=== name ===" followed by the usual output, or its error)
+// in batch order as soon as everything before it is done.
+void runBatch(PuzzleOptions const &options) {
+    vector<BatchItem> items = collectBatch(options.batch_source);
+    unsigned jobs = static_cast<unsigned>(min<size_t>(options.jobs, max<size_t>(items.size(), 1)));
+
+    // --stats=FILE gets a JSON array with one object per solved puzzle, in batch order
+    ofstream stats_file;
+    if (!options.stats_file.empty()) {
+        stats_file.open(options.stats_file);
+        if (!stats_file) {
+            cerr << "Error: cannot write " << options.stats_file << "\n";
+            exit(1);
+        }
+    }
+    vector<string> stats_json(items.size());
+
+    unique_ptr<SolutionCache> cache = openCache(options);
+    vector<Solver> solvers(jobs);
+    vector<SolveResult> results(jobs);
+    vector<string> records(items.size()), logs(items.size());
+    vector<bool> finished(items.size(), false);
+    size_t next_to_write = 0;
+    mutex write_lock;
+    atomic<size_t> next_item{0};
+
+    auto work = [&](unsigned worker) {
+        for (size_t i = next_item++; i < items.size(); i = next_item++) {
+            BatchItem const &item = items[i];
+            ostringstream out, log;
+            out << "=== " << item.name << " ===\n";
+            // Stream items are parsed in place; items outlives the map
+            auto parse_start = chrono::steady_clock::now();
+            PuzzleMap map;
+            string message;
+            ParseError error = item.path.empty()
+                ? parsePuzzle(item.text.data(), item.text.data() + item.text.size(), nullptr, map, message)
+                : readPuzzleFile(item.path, map, message);
+            double parse_ms = elapsedMs(parse_start);
+            if (error != ParseError::kNone) {
+                out << message << "\n";
+            } else {
+                if (options.verbose) {
+                    log << "Parse time: " << parse_ms << " ms\n";
+                }
+                double output_ms = solvePuzzle(solvers[worker], cache.get(), results[worker], map, options, out,
+                                               log);
+                if (options.solve.stats && options.stats_file.empty()) {
+                    writeStatsText(results[worker], map, parse_ms, output_ms, log);
+                } else if (options.solve.stats) {
+                    ostringstream json;
+                    writeStatsJson(results[worker], map, parse_ms, output_ms, item.name, json);
+                    stats_json[i] = json.str();
                 }
             }
-            
-            // Print original character if discovered, '#' otherwise
-            if (discovered) {
-                cout << map.grid[row][col];
-            } else {
-                cout << '#';
+
+            lock_guard<mutex> lock(write_lock);
+            records[i] = out.str();
+            logs[i] = log.str();
+            finished[i] = true;
+            while (next_to_write < items.size() && finished[next_to_write]) {
+                cout << records[next_to_write];
+                cerr << logs[next_to_write];
+                string().swap(records[next_to_write]);
+                string().swap(logs[next_to_write]);
+                ++next_to_write;
+            }
+        }
+    };
+
+    WorkerPool pool(jobs);
+    pool.run(work);
+    cout << flush;
+    if (stats_file.is_open()) {
+        stats_file << "[";
+        bool first = true;
+        for (string const &json : stats_json) {
+            if (!json.empty()) {
+                stats_file << (first ? "\n  " : ",\n  ") << json;
+                first = false;
             }
         }
-        cout << '\n';
+        stats_file << "\n]\n";
+    }
+    if (options.verbose) {
+        printCacheCounters(cache.get(), cerr);
+        cerr << "Peak RSS: " << peakRssKb() << " KB\n";
     }
 }
 
 
 
-void solvePuzzle(vector<vector<vector<char>>>& btrace, PuzzleMap const &map, deque<Coord> sc, PuzzleOptions const &options) {
-    // Initialize start
-    sc.push_back(map.start);
-    btrace[0][map.start.row][map.start.column] = '@';
-    Coord current_state = map.start;
 
-    bool solution_found = false;
-    Coord solution_state = map.start;
 
-    // While loop
-    while(!sc.empty()) {
-        if (options.search_mode == SearchMode::kQueue) {
-            current_state = sc.front();
-            sc.pop_front();
+
+
+
+
+// --index: builds the region index once and answers every query line of the file with it.
+// Each query's output follows a "=== start_row start_col target_row target_col ===" line;
+// with --output reach it's just "... reachable" or "... unreachable" per line.
+void runIndex(PuzzleMap const &map, PuzzleOptions const &options) {
+    ifstream queries(options.index_queries);
+    if (!queries) {
+        cerr << "Error: cannot read " << options.index_queries << "\n";
+        exit(1);
+    }
+    auto build_start = chrono::steady_clock::now();
+    ReachabilityIndex index(map);
+    if (options.verbose) {
+        cerr << "Index build time: " << elapsedMs(build_start) << " ms (" << index.numRegions() << " regions, "
+             << index.numPresses() << " presses)\n";
+    }
+
+    bool want_output = options.output_type != OutputType::kReach;
+    SolveResult result;
+    string line, reach;
+    uint64_t line_number = 0, count = 0, regions = 0;
+    double query_ms = 0;
+    while (getline(queries, line)) {
+        ++line_number;
+        if (isBlankOrComment(line)) {
+            continue;
+        }
+        istringstream fields(line);
+        uint64_t sr = 0, sc = 0, tr = 0, tc = 0;
+        if (!(fields >> sr >> sc >> tr >> tc) || !(fields >> ws).eof()) {
+            cerr << "Error: " << options.index_queries << ":" << line_number
+                 << ": expected 'start_row start_col target_row target_col'\n";
+            exit(1);
+        }
+        string name = to_string(sr) + " " + to_string(sc) + " " + to_string(tr) + " " + to_string(tc);
+        bool in_grid = sr < map.height && sc < map.width && tr < map.height && tc < map.width;
+        uint64_t start_cell = in_grid ? sr * map.width + sc : map.layerSize();
+        uint64_t target_cell = in_grid ? tr * map.width + tc : map.layerSize();
+
+        auto query_start = chrono::steady_clock::now();
+        SolveStatus status = index.query(start_cell, target_cell, want_output, result);
+        query_ms += elapsedMs(query_start);
+        ++count;
+        regions += result.expanded;
+
+        if (!want_output) {
+            reach += name + (status == SolveStatus::kSolved ? " reachable\n"
+                             : status == SolveStatus::kNoSolution ? " unreachable\n" : " invalid\n");
+            continue;
+        }
+        cout << "=== " << name << " ===\n";
+        if (status == SolveStatus::kInvalidOptions) {
+            cout << "Invalid query: start and target must be two different floor cells\n";
         } else {
-            current_state = sc.back();
-            sc.pop_back();
+            printResult(withEndpoints(map, start_cell, target_cell), result, options, cout);
         }
+    }
+    cout << reach << flush;
+    if (options.verbose) {
+        cerr << "Queries: " << count << " in " << query_ms << " ms (" << regions << " regions expanded)\n";
+        cerr << "Peak RSS: " << peakRssKb() << " KB\n";
+    }
+}
 
-        // Check if active button
-        char b = map.grid[current_state.row][current_state.column];
-        
-        // If its a button/^ AND we're in a color state other than button color
-        if ((islower(b) || b == '^') && (charToNum(b) != current_state.color)) {
-            uint32_t new_color = charToNum(b);
-            // If where the button leads to is undiscovered
-            if (btrace[new_color][current_state.row][current_state.column] == '-') {
-                // Add that undiscovered spot to search container
-                Coord button_state{new_color, current_state.row, current_state.column};
-                btrace[new_color][current_state.row][current_state.column] = numToChar(current_state.color);
-                sc.push_back(button_state);
-
-                    if (b == '?') {
-                        solution_found = true;
-                        solution_state = button_state;
-                        break;
-                    }
-            }
-            continue;  // Skip adjacent checks after button press
+// "convert [--to text|binary] [--planes] IN OUT": rewrites a puzzle in the other format
+// (or the one given with --to). IN and OUT may be "-" for stdin/stdout.
+int runConvert(int argc, char **argv) {
+    struct option long_options[] = {
+            {"to", required_argument, nullptr, 't'},
+            {"planes", no_argument, nullptr, 'p'},
+            { nullptr, 0, nullptr, '\0' }
+        };
+    string to;
+    bool planes = false;
+    int choice = 0;
+    int option_index = 0;
+    while ((choice = getopt_long(argc, argv, "t:p", long_options, &option_index)) != -1) {
+        if (choice == 't' && (string(optarg) == "text" || string(optarg) == "binary")) {
+            to = optarg;
+        } else if (choice == 'p') {
+            planes = true;
+        } else {
+            cerr << "Error: usage: convert [--to text|binary] [--planes] IN OUT\n";
+            exit(1);
         }
-        // Check finish
-        else if (b == '?') {
-            solution_found = true;
-            solution_state = current_state;
-            break;
-        } 
-        // Check adjacent locations
-        else {
-            // Determine if doors should be closed (only if current cell is ^)
-            bool trap_doors_closed = (b == '^');
-            
-            // North
-            if(current_state.row > 0) {
-                if(btrace[current_state.color][current_state.row-1][current_state.column] == '-') {
-                    char n = map.grid[current_state.row-1][current_state.column];
-                    if ((n == '.') || (islower(n)) || 
-                        (n == toupper(numToChar(current_state.color)) && !trap_doors_closed) || 
-                        (n == '^') || 
-                        (n == '?') || ((n == '@') && current_state.color != 0)) {
-                        Coord north{current_state.color, current_state.row-1, current_state.column};
-                        btrace[north.color][north.row][north.column] = 'S';
-                        sc.push_back(north);
-
-                        if (n == '?') {
-                            solution_found = true;
-                            solution_state = north;
-                            break;
-                        }
-                    }
-                }
-            }
-            // East
-            if(current_state.column < map.width-1) {
-                if(btrace[current_state.color][current_state.row][current_state.column+1] == '-') {
-                    char e = map.grid[current_state.row][current_state.column+1];
-                    if ((e == '.') || (islower(e)) || 
-                        (e == toupper(numToChar(current_state.color)) && !trap_doors_closed) || 
-                        (e == '^') || 
-                        (e == '?') || ((e == '@') && current_state.color != 0)) {
-                        Coord east{current_state.color, current_state.row, current_state.column+1};
-                        btrace[east.color][east.row][east.column] = 'W';
-                        sc.push_back(east);
-
-                        if (e == '?') {
-                            solution_found = true;
-                            solution_state = east;
-                            break;
-                        }
-
-                    }
-                }
-            }
-            // South 
-            if(current_state.row < map.height-1) {
-                if(btrace[current_state.color][current_state.row+1][current_state.column] == '-') {
-                    char s = map.grid[current_state.row+1][current_state.column];
-                    if ((s == '.') || (islower(s)) || 
-                        (s == toupper(numToChar(current_state.color)) && !trap_doors_closed) || 
-                        (s == '^') || 
-                        (s == '?') || ((s == '@') && current_state.color != 0)) {
-                        Coord south{current_state.color, current_state.row+1, current_state.column};
-                        btrace[south.color][south.row][south.column] = 'N';
-                        sc.push_back(south);
-
-                        if (s == '?') {
-                            solution_found = true;
-                            solution_state = south;
-                            break;
-                        }
-                    }
-                }
-            }
-            // West 
-            if(current_state.column > 0) {
-                if(btrace[current_state.color][current_state.row][current_state.column-1] == '-') {
-                    char w = map.grid[current_state.row][current_state.column-1];
-                    if ((w == '.') || (islower(w)) || 
-                        (w == toupper(numToChar(current_state.color)) && !trap_doors_closed) || 
-                        (w == '^') || 
-                        (w == '?') || ((w == '@') && current_state.color != 0)){
-                        Coord west{current_state.color, current_state.row, current_state.column-1};
-                        btrace[west.color][west.row][west.column] = 'E';
-                        sc.push_back(west);
-
-                        if (w == '?') {
-                            solution_found = true;
-                            solution_state = west;
-                            break;
-                        }
-                    }
-                }
-            }
+    }
+    if (argc - optind != 2) {
+        cerr << "Error: usage: convert [--to text|binary] [--planes] IN OUT\n";
+        exit(1);
+    }
+    string in_path = argv[optind], out_path = argv[optind + 1];
+
+    auto bytes = make_shared<string>();
+    if (in_path == "-") {
+        bytes->assign(istreambuf_iterator<char>(cin), istreambuf_iterator<char>());
+    } else {
+        ifstream in(in_path, ios::binary);
+        if (!in) {
+            cerr << "Error: cannot open " << in_path << "\n";
+            exit(1);
         }
+        bytes->assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+    bool binary_in = isBinaryPuzzle(bytes->data(), bytes->data() + bytes->size());
+    PuzzleMap map;
+    string message;
+    if (parsePuzzle(bytes->data(), bytes->data() + bytes->size(), bytes, map, message) != ParseError::kNone) {
+        cerr << message << "\n";
+        exit(1);
     }
 
-    // Output handling 
-    if(solution_found) {
-        if (options.output_type == OutputType::kList) {
-            generateListOutput(solution_state, btrace);
+    PuzzleFormat format = to.empty() ? (binary_in ? PuzzleFormat::kText : PuzzleFormat::kBinary)
+                                     : (to == "text" ? PuzzleFormat::kText : PuzzleFormat::kBinary);
+    if (planes && format != PuzzleFormat::kBinary) {
+        cerr << "Error: --planes only applies to binary output\n";
+        exit(1);
+    }
+    bool written = false;
+    if (out_path == "-") {
+        written = writePuzzle(map, format, planes, cout) && cout.flush();
+    } else {
+        ofstream out(out_path, ios::binary);
+        written = writePuzzle(map, format, planes, out) && out.flush();
+    }
+    if (!written) {
+        cerr << "Error: cannot write " << out_path << "\n";
+        exit(1);
+    }
+    return 0;
+}
+
+// --edits: solves the puzzle once, then for every "row col char" line of the file edits
+// that cell and prints the repaired result after a "=== row col char ===" line. The
+// first result follows "=== initial ===".
+void runEdits(PuzzleMap const &map, PuzzleOptions const &options) {
+    ifstream edits(options.edits);
+    if (!edits) {
+        cerr << "Error: cannot read " << options.edits << "\n";
+        exit(1);
+    }
+    auto solve_start = chrono::steady_clock::now();
+    IncrementalSolver solver(map);
+    SolveResult result;
+    solver.solve(result);
+    if (options.verbose) {
+        cerr << "Initial solve time: " << elapsedMs(solve_start) << " ms (" << result.expanded << " states)\n";
+    }
+    cout << "=== initial ===\n";
+    printResult(solver.map(), result, options, cout);
+
+    string line;
+    uint64_t line_number = 0, count = 0, recomputed = 0;
+    double edit_ms = 0;
+    while (getline(edits, line)) {
+        ++line_number;
+        if (isBlankOrComment(line)) {
+            continue;
         }
-        else if (options.output_type == OutputType::kMap) {
-            generateMapOutput(map, solution_state, btrace);
+        istringstream fields(line);
+        uint64_t row = 0, column = 0;
+        string cell_char;
+        if (!(fields >> row >> column >> cell_char) || cell_char.size() != 1 || !(fields >> ws).eof()) {
+            cerr << "Error: " << options.edits << ":" << line_number << ": expected 'row col char'\n";
+            exit(1);
         }
-    } 
-    else if (sc.empty()) {
-        printNoSolutionOutput(map, btrace);
+        cout << "=== " << row << " " << column << " " << cell_char << " ===\n";
+        auto edit_start = chrono::steady_clock::now();
+        bool in_grid = row < map.height && column < map.width;
+        if (!in_grid || !solver.edit(row * map.width + column, cell_char[0])) {
+            cout << "Invalid edit: the cell must be on the grid, not the '@' or '?', and the char valid\n";
+            continue;
+        }
+        solver.solve(result);
+        edit_ms += elapsedMs(edit_start);
+        ++count;
+        recomputed += result.expanded;
+        printResult(solver.map(), result, options, cout);
+    }
+    cout << flush;
+    if (options.verbose) {
+        cerr << "Edits: " << count << " in " << edit_ms << " ms (" << recomputed << " states recomputed)\n";
+        cerr << "Peak RSS: " << peakRssKb() << " KB\n";
     }
 }
 
-
-
-
-
-
-
-
-
 int main(int argc, char * argv[]) {
     ios_base::sync_with_stdio(false);
+    if (argc > 1 && string(argv[1]) == "convert") {
+        return runConvert(argc - 1, argv + 1);
+    }
     PuzzleOptions options;
 
 // Get options
     getOptions(argc, argv, options);
-// Read in map
-    PuzzleMap map = readInput();
 
-// make backtrace 3D Vector
-    vector<vector<vector<char>>> btrace = createBacktraceMap (map);
-// make search_container deque
-    deque<Coord> search_container;
-
-// Find map solution and generate output
-    solvePuzzle(btrace, map, search_container, options);
+    if (!options.batch_source.empty()) {
+        runBatch(options);
+        return 0;
+    }
+// Read in map
+    auto parse_start = chrono::steady_clock::now();
+    PuzzleMap map;
+    string message;
+    ParseError error = options.input_file.empty() ? readPuzzle(cin, map, message)
+                                                  : readPuzzleFile(options.input_file, map, message);
+    if (error != ParseError::kNone) {
+        cerr << message << "\n";
+        exit(1);
+    }
+    double parse_ms = elapsedMs(parse_start);
+    if (options.verbose) {
+        cerr << "Parse time: " << parse_ms << " ms\n";
+    }
 
+    if (!options.index_queries.empty()) {
+        runIndex(map, options);
+        return 0;
+    }
+    if (!options.edits.empty()) {
+        runEdits(map, options);
+        return 0;
+    }
 
-}
\ No newline at end of file
+// Find map solution and generate output; the solver keeps its bitmaps, backtrace and search container
+    if (options.portfolio.empty() && (options.solve.time_limit != 0 || !options.solve.checkpoint.empty())) {
+        options.solve.progress = [](uint64_t expanded, uint64_t bound) {
+            cerr << "Progress: " << expanded << " / " << bound << " states ("
+                 << 100.0 * static_cast<double>(expanded) / static_cast<double>(bound) << "%)\n";
+        };
+    }
+    unique_ptr<SolutionCache> cache = openCache(options);
+    Solver solver;
+    SolveResult result;
+    double output_ms = solvePuzzle(solver, cache.get(), result, map, options, cout, cerr);
+    if (result.status == SolveStatus::kSpillFailed || result.status == SolveStatus::kCheckpointFailed) {
+        exit(1);
+    }
+    if (result.status == SolveStatus::kTimedOut) {
+        exit(2);
+    }
+    if (options.verbose) {
+        cout << flush;
+        cerr << "Peak RSS: " << peakRssKb() << " KB\n";
+    }
+    if (options.solve.stats && options.stats_file.empty()) {
+        cout << flush;
+        writeStatsText(result, map, parse_ms, output_ms, cerr);
+    } else if (options.solve.stats) {
+        ofstream stats_file(options.stats_file);
+        writeStatsJson(result, map, parse_ms, output_ms, options.input_file.empty() ? "stdin" : options.input_file,
+                       stats_file);
+        stats_file << "\n";
+        if (!stats_file) {
+            cerr << "Error: cannot write " << options.stats_file << "\n";
+            exit(1);
+        }
+    }
+}
@@ -0,0 +1,3880 @@
+// Identifier: A8A3A33EF075ACEF9B08F5B9845569ECCB423725
+#include "solver.h"
+#include "worker_pool.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <unordered_map>
+#include <cstdint>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <fstream>
+#include <filesystem>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <cstring>
+#include <cstdio>
+#include <charconv>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+using namespace std;
+
+uint32_t charToNum(char c) { 
+    if (c == '^') return 0;
+    if (isupper(c)) return static_cast<uint32_t>(c - 'A' + 1);
+    if (islower(c)) return static_cast<uint32_t>(c - 'a' + 1);
+    return kNoColor;
+}
+
+char numToChar(uint32_t num) {
+    if (num == 0) return '^';
+    if (num >= 1 && num <= 26) return 'a' + static_cast<char>(num - 1);
+    if (num == 27) return 'z';
+    return '\0';
+}
+
+
+
+bool isValidChar(char c, uint32_t num_colors) {
+    if (c == '@' || c == '#' || c == '^' || c == '.' || c == '?') {
+        return true;
+    } else if (isupper(c)) { 
+        return (static_cast<uint32_t>(c-'A') < (num_colors));
+    } else if (islower(c)) {
+        return (static_cast<uint32_t>(c-'a') < (num_colors));
+    } else {return false;}
+}
+
+
+
+// Binary layout (little-endian): this header, then the cells row after row, one char per
+// cell exactly as in the text format and zero-padded to a multiple of 8 bytes, then with
+// kBinaryPlanes the passable planes of PuzzleMap::planes. The checksum covers the header
+// (with checksum = 0) and everything after it.
+struct BinaryHeader {
+    char magic[8];
+    uint32_t num_colors;
+    uint32_t height;
+    uint32_t width;
+    uint32_t flags;
+    uint64_t start;  // cell of the '@'
+    uint64_t target; // cell of the '?'
+    uint64_t payload_bytes;
+    uint64_t checksum;
+    uint64_t reserved;
+};
+static_assert(sizeof(BinaryHeader) == 64, "the cells must start 8-byte aligned");
+
+char const kBinaryMagic[8] = {'P', 'Z', 'L', 'B', 'I', 'N', '0', '1'};
+uint32_t const kBinaryPlanes = 1;
+
+uint64_t binaryCellBytes(uint64_t layer) { return (layer + 7) / 8 * 8; }
+uint64_t binaryPlaneBytes(uint32_t num_colors, uint64_t layer) { return (num_colors + 1) * ((layer + 63) / 64) * 8; }
+
+// Word at a time so checking a big file costs about as much as reading it; each step is
+// invertible, so any single changed word always changes the result
+uint64_t checksumBytes(uint64_t hash, char const *data, size_t size) {
+    auto mix = [&](uint64_t word) {
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 32;
+    };
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        mix(word);
+    }
+    if (size > 0) {
+        uint64_t word = 0;
+        memcpy(&word, data, size);
+        mix(word);
+    }
+    return hash;
+}
+
+uint64_t checksumBinary(BinaryHeader header, char const *payload) {
+    header.checksum = 0;
+    uint64_t hash = checksumBytes(0, reinterpret_cast<char const *>(&header), sizeof header);
+    return checksumBytes(hash, payload, header.payload_bytes);
+}
+
+bool isBinaryPuzzle(char const *begin, char const *end) {
+    return end - begin >= 8 && memcmp(begin, kBinaryMagic, 8) == 0;
+}
+
+// Checks the header and the checksum only; the grid and planes are views of the bytes
+ParseError parseBinaryPuzzle(char const *begin, char const *end, shared_ptr<void const> owner,
+                             PuzzleMap &result, string &message) {
+    auto fail = [&](ParseError error, string text) {
+        message = move(text);
+        return error;
+    };
+    BinaryHeader header;
+    if (static_cast<size_t>(end - begin) < sizeof header) {
+        return fail(ParseError::kBinary, "Error: binary puzzle is truncated");
+    }
+    memcpy(&header, begin, sizeof header);
+    if (header.num_colors > 26) {
+        return fail(ParseError::kColorCount, "Error: must have 0 <= num_colors <= 26");
+    }
+    if (header.height < 1 || header.width < 1) {
+        return fail(ParseError::kSize, "Error: height and width must be >= 1");
+    }
+    if (header.flags & ~kBinaryPlanes) {
+        return fail(ParseError::kBinary, "Error: binary puzzle has unknown flags");
+    }
+    uint64_t layer = uint64_t{header.height} * header.width;
+    uint64_t payload_bytes = binaryCellBytes(layer);
+    if (header.flags & kBinaryPlanes) {
+        payload_bytes += binaryPlaneBytes(header.num_colors, layer);
+    }
+    if (header.payload_bytes != payload_bytes ||
+        static_cast<uint64_t>(end - begin) - sizeof header < payload_bytes) {
+        return fail(ParseError::kBinary, "Error: binary puzzle is truncated");
+    }
+    if (header.start >= layer || header.target >= layer || header.start == header.target) {
+        return fail(ParseError::kStartTarget, "Error: Missing/excess '@' or '?'");
+    }
+    char const *payload = begin + sizeof header;
+    if (checksumBinary(header, payload) != header.checksum) {
+        return fail(ParseError::kBinary, "Error: binary puzzle checksum mismatch");
+    }
+
+    // The planes are read as words; bytes that aren't 8-byte aligned (a stream read into
+    // an odd buffer) get an aligned copy instead
+    if (reinterpret_cast<uintptr_t>(payload) % alignof(uint64_t) != 0) {
+        auto copy = make_shared<vector<uint64_t>>(payload_bytes / 8);
+        memcpy(copy->data(), payload, payload_bytes);
+        payload = reinterpret_cast<char const *>(copy->data());
+        owner = move(copy);
+    }
+    PuzzleMap map;
+    map.num_colors = header.num_colors;
+    map.height = header.height;
+    map.width = header.width;
+    map.start = Coord{header.start};
+    map.target = Coord{header.target};
+    if (header.flags & kBinaryPlanes) {
+        map.planes = reinterpret_cast<uint64_t const *>(payload + binaryCellBytes(layer));
+    }
+    map.grid.view(payload, map.width, map.width, move(owner));
+    result = move(map);
+    return ParseError::kNone;
+}
+
+// One pass straight over the raw bytes: comment lines are skipped and chars validated in
+// place, no per-line strings. Same rules and error messages the old getline-based reader
+// had. The grid is a view of the bytes if every row is the same distance from the next
+// (the normal case), otherwise a compact copy.
+ParseError parsePuzzle(char const *begin, char const *end, shared_ptr<void const> owner,
+                       PuzzleMap &result, string &message) {
+    if (isBinaryPuzzle(begin, end)) {
+        return parseBinaryPuzzle(begin, end, move(owner), result, message);
+    }
+    PuzzleMap map;
+    char const *p = begin;
+    auto fail = [&](ParseError error, string text) {
+        message = move(text);
+        return error;
+    };
+
+// Reading in map parameters
+    auto readNumber = [&](uint32_t &value) {
+        while (p < end && isspace(static_cast<unsigned char>(*p))) ++p;
+        if (p == end || !isdigit(static_cast<unsigned char>(*p))) return false;
+        uint64_t number = 0;
+        while (p < end && isdigit(static_cast<unsigned char>(*p))) {
+            number = number * 10 + static_cast<uint64_t>(*p++ - '0');
+            if (number > UINT32_MAX) return false;
+        }
+        value = static_cast<uint32_t>(number);
+        return true;
+    };
+    if (!(readNumber(map.num_colors) && readNumber(map.height) && readNumber(map.width))) {
+        return fail(ParseError::kMissingSize, "Error: must specify num_colors, height, width!");
+    }
+// Checking valid map parameters
+    if (!(map.num_colors <= 26)) {
+        return fail(ParseError::kColorCount, "Error: must have 0 <= num_colors <= 26");
+    }
+    if (map.height < 1 || map.width < 1) {
+        return fail(ParseError::kSize, "Error: height and width must be >= 1");
+    }
+
+// Lines are [line, line + length). Past the end of input this behaves like getline did:
+// one empty line after a trailing newline, otherwise the last line is read again
+    char const *line = end;
+    size_t length = 0;
+    bool terminated = false;
+    auto nextLine = [&] {
+        if (p == end) {
+            if (terminated) {
+                length = 0;
+                terminated = false;
+            }
+            return;
+        }
+        line = p;
+        char const *eol = static_cast<char const *>(memchr(p, '\n', static_cast<size_t>(end - p)));
+        terminated = eol != nullptr;
+        length = static_cast<size_t>((eol ? eol : end) - p);
+        p = eol ? eol + 1 : end;
+    };
+
+// Ignoring comments (starting with the rest of the header line)
+    for (;;) {
+        bool more = p < end;
+        nextLine();
+        if (!more || !(length == 0 || (length >= 2 && line[0] == '/' && line[1] == '/'))) break;
+    }
+
+// Track number of starts and targets read
+    uint32_t num_starts = 0, num_targets = 0;
+    bool valid[256];
+    for (int c = 0; c < 256; ++c) {
+        valid[c] = isValidChar(static_cast<char>(c), map.num_colors);
+    }
+    char const *first_row = line;
+    uint64_t stride = map.width;
+    bool evenly_spaced = true;
+
+// For each row/line
+    for (uint32_t i = 0; i < map.height; ++i) {
+        if (i > 0) {
+            nextLine();
+            if (i == 1) {
+                stride = static_cast<uint64_t>(line - first_row);
+            }
+            evenly_spaced = evenly_spaced && line == first_row + i * stride;
+        }
+// For each char in line
+        for (uint32_t j = 0; j < map.width; ++j) {
+            char c = j < length ? line[j] : '\0';
+
+// Check valid character
+            if (!valid[static_cast<unsigned char>(c)]) {
+                return fail(ParseError::kInvalidChar,
+                            string("Error: Invalid char '") + c + "' in line " + string(line, length));
+            }
+
+// Track start/target
+            if (c == '@') {
+                map.start = map.coordOf(charToNum('^'),i,j);
+                num_starts++;
+            } else if (c == '?') {
+                map.target = map.coordOf(charToNum('^'),i,j);
+                num_targets++;
+            }
+        }
+    }
+
+// Validate start/target counts at the end
+    if (num_starts != 1 || num_targets != 1) {
+        return fail(ParseError::kStartTarget, "Error: Missing/excess '@' or '?'");
+    }
+
+    if (evenly_spaced) {
+        map.grid.view(first_row, stride, map.width, move(owner));
+    } else {
+        // Rows of different lengths; gather a compact copy
+        auto cells = make_shared<vector<char>>();
+        cells->reserve(map.layerSize());
+        p = first_row;
+        for (uint32_t i = 0; i < map.height; ++i) {
+            nextLine();
+            cells->insert(cells->end(), line, line + map.width);
+        }
+        map.grid.view(cells->data(), map.width, map.width, cells);
+    }
+    result = move(map);
+    return ParseError::kNone;
+}
+
+ParseError readPuzzle(istream &in, PuzzleMap &map, string &message) {
+    auto text = make_shared<string>(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    return parsePuzzle(text->data(), text->data() + text->size(), text, map, message);
+}
+
+// A read-only mapping of a whole file, unmapped once the last grid viewing it is gone
+struct MappedFile {
+    char const *data = nullptr;
+    size_t size = 0;
+
+    ~MappedFile() {
+        if (data) {
+            munmap(const_cast<char *>(data), size);
+        }
+    }
+};
+
+ParseError readPuzzleFile(string const &path, PuzzleMap &map, string &message) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        message = "Error: cannot open " + path;
+        return ParseError::kFile;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        message = "Error: cannot read " + path;
+        return ParseError::kFile;
+    }
+    auto file = make_shared<MappedFile>();
+    file->size = static_cast<size_t>(info.st_size);
+    if (file->size > 0) {
+        void *mapped = mmap(nullptr, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            close(fd);
+            message = "Error: cannot map " + path;
+            return ParseError::kFile;
+        }
+        madvise(mapped, file->size, MADV_SEQUENTIAL);
+        file->data = static_cast<char const *>(mapped);
+    }
+    close(fd);
+    return parsePuzzle(file->data, file->data + file->size, file, map, message);
+}
+
+
+
+// Bit helpers for the vector<uint64_t> bitmaps below
+inline uint64_t testBit(vector<uint64_t> const &bits, uint64_t i) {
+    return (bits[i >> 6] >> (i & 63)) & 1;
+}
+inline void setBit(vector<uint64_t> &bits, uint64_t i) { bits[i >> 6] |= uint64_t{1} << (i & 63); }
+inline void clearBit(vector<uint64_t> &bits, uint64_t i) { bits[i >> 6] &= ~(uint64_t{1} << (i & 63)); }
+
+// First bit in [from, end) that differs from `skip` (0 or 1), or end if there is none
+inline uint64_t findBit(vector<uint64_t> const &bits, uint64_t from, uint64_t end, uint64_t skip) {
+    uint64_t const flip = skip ? ~uint64_t{0} : 0;
+    if (from >= end) {
+        return end;
+    }
+    uint64_t w = from >> 6;
+    uint64_t word = (bits[w] ^ flip) & (~uint64_t{0} << (from & 63));
+    while (word == 0) {
+        if (++w * 64 >= end) {
+            return end;
+        }
+        word = bits[w] ^ flip;
+    }
+    return min(end, w * 64 + __builtin_ctzll(word));
+}
+// Clears bits [from, end)
+inline void clearBits(vector<uint64_t> &bits, uint64_t from, uint64_t end) {
+    for (; from < end && (from & 63); ++from) {
+        clearBit(bits, from);
+    }
+    for (; from + 64 <= end; from += 64) {
+        bits[from >> 6] = 0;
+    }
+    for (; from < end; ++from) {
+        clearBit(bits, from);
+    }
+}
+
+// Versions safe to call from several threads on the same bitmap
+inline uint64_t testBitAtomic(vector<uint64_t> const &bits, uint64_t i) {
+    return (__atomic_load_n(&bits[i >> 6], __ATOMIC_RELAXED) >> (i & 63)) & 1;
+}
+inline void setBitAtomic(vector<uint64_t> &bits, uint64_t i) {
+    __atomic_fetch_or(&bits[i >> 6], uint64_t{1} << (i & 63), __ATOMIC_RELAXED);
+}
+inline void clearBitAtomic(vector<uint64_t> &bits, uint64_t i) {
+    __atomic_fetch_and(&bits[i >> 6], ~(uint64_t{1} << (i & 63)), __ATOMIC_RELAXED);
+}
+// Clears a set bit, returns true only for the one thread that actually cleared it
+inline bool claimBit(vector<uint64_t> &bits, uint64_t i) {
+    uint64_t mask = uint64_t{1} << (i & 63);
+    if (!(__atomic_load_n(&bits[i >> 6], __ATOMIC_RELAXED) & mask)) {
+        return false;
+    }
+    return __atomic_fetch_and(&bits[i >> 6], ~mask, __ATOMIC_RELAXED) & mask;
+}
+
+// Per-cell bitmaps built at the start of every solve so the search never looks at raw grid chars
+// for ordinary moves. passable holds one layer per color laid out like Coord indices,
+// shifted by `pad` zero bits so probing a neighbor off the edge of the state space
+// still lands inside the vector.
+struct CellMaps {
+    uint64_t pad = 0;
+    vector<uint64_t> passable;  // state can be stepped onto (floor, buttons, traps, target, own doors)
+    vector<uint64_t> buttons;   // lowercase buttons and '^' traps, one bit per cell
+    vector<uint64_t> traps;     // '^' only
+    vector<uint64_t> has_east;  // cell is not in the last column
+    vector<uint64_t> has_west;  // cell is not in the first column
+};
+
+// OR nbits bits of src (starting at bit 0) into dst starting at bit dst_offset
+void orBitsAt(vector<uint64_t> &dst, uint64_t dst_offset, uint64_t const *src, uint64_t nbits) {
+    uint64_t shift = dst_offset & 63;
+    uint64_t base = dst_offset >> 6;
+    for (uint64_t w = 0; w * 64 < nbits; ++w) {
+        uint64_t bits = src[w];
+        if (nbits - w * 64 < 64) {
+            bits &= (uint64_t{1} << (nbits - w * 64)) - 1;
+        }
+        dst[base + w] |= bits << shift;
+        if (shift != 0 && bits >> (64 - shift)) {
+            dst[base + w + 1] |= bits >> (64 - shift);
+        }
+    }
+}
+
+// Clears the bits of dst starting at dst_offset where the first nbits bits of src are set
+void clearBitsAt(vector<uint64_t> &dst, uint64_t dst_offset, uint64_t const *src, uint64_t nbits) {
+    uint64_t shift = dst_offset & 63;
+    uint64_t base = dst_offset >> 6;
+    for (uint64_t w = 0; w * 64 < nbits; ++w) {
+        uint64_t bits = src[w];
+        if (nbits - w * 64 < 64) {
+            bits &= (uint64_t{1} << (nbits - w * 64)) - 1;
+        }
+        dst[base + w] &= ~(bits << shift);
+        if (shift != 0 && bits >> (64 - shift)) {
+            dst[base + w + 1] &= ~(bits >> (64 - shift));
+        }
+    }
+}
+
+// The 64 bits of bits starting at bit `from`, with anything outside the vector read as 0
+inline uint64_t bitsFrom(vector<uint64_t> const &bits, int64_t from) {
+    int64_t const w = from >> 6; // floor, also for negative from
+    uint64_t const shift = static_cast<uint64_t>(from) & 63;
+    auto word = [&](int64_t i) { return i >= 0 && static_cast<uint64_t>(i) < bits.size() ? bits[i] : 0; };
+    return shift == 0 ? word(w) : (word(w) >> shift) | (word(w + 1) << (64 - shift));
+}
+
+// Fills maps for this puzzle, reusing whatever capacity it already has
+void buildCellMaps(PuzzleMap const &map, CellMaps &maps) {
+    uint64_t layer = map.layerSize();
+    uint64_t cell_words = (layer + 63) / 64;
+    maps.pad = (map.width / 64 + 1) * 64;
+    maps.passable.assign((map.numStates() + 2 * maps.pad + 63) / 64, 0);
+    maps.buttons.assign(cell_words, 0);
+    maps.traps.assign(cell_words, 0);
+    maps.has_east.assign(cell_words, 0);
+    maps.has_west.assign(cell_words, 0);
+
+    // Floor, buttons, traps and the target are open in every color
+    vector<uint64_t> everywhere(map.planes ? 0 : cell_words, 0);
+    for (uint64_t row = 0, cell = 0; row < map.height; ++row) {
+        char const *chars = map.grid.row(row);
+        for (uint64_t column = 0; column < map.width; ++column, ++cell) {
+            char c = chars[column];
+            if (column + 1 < map.width) setBit(maps.has_east, cell);
+            if (column > 0) setBit(maps.has_west, cell);
+            if (islower(c) || c == '^') setBit(maps.buttons, cell);
+            if (c == '^') setBit(maps.traps, cell);
+            if (!map.planes && (c == '.' || islower(c) || c == '^' || c == '?')) setBit(everywhere, cell);
+        }
+    }
+    if (map.planes) {
+        // A binary puzzle stored the finished layers
+        for (uint32_t color = 0; color <= map.num_colors; ++color) {
+            orBitsAt(maps.passable, color * layer + maps.pad, map.planes + color * cell_words, layer);
+        }
+        return;
+    }
+    for (uint32_t color = 0; color <= map.num_colors; ++color) {
+        orBitsAt(maps.passable, color * layer + maps.pad, everywhere.data(), layer);
+    }
+    // A door only in its own color and the start in every color but '^'
+    for (uint64_t row = 0, cell = 0; row < map.height; ++row) {
+        char const *chars = map.grid.row(row);
+        for (uint64_t column = 0; column < map.width; ++column, ++cell) {
+            char c = chars[column];
+            if (isupper(c) && charToNum(c) <= map.num_colors) {
+                setBit(maps.passable, charToNum(c) * layer + cell + maps.pad);
+            } else if (c == '@') {
+                for (uint32_t color = 1; color <= map.num_colors; ++color) {
+                    setBit(maps.passable, color * layer + cell + maps.pad);
+                }
+            }
+        }
+    }
+}
+
+bool writePuzzle(PuzzleMap const &map, PuzzleFormat format, bool with_planes, ostream &out) {
+    uint64_t layer = map.layerSize();
+    if (format == PuzzleFormat::kText) {
+        out << map.num_colors << " " << map.height << " " << map.width << "\n";
+        for (uint32_t row = 0; row < map.height; ++row) {
+            out.write(map.grid.row(row), map.width);
+            out.put('\n');
+        }
+        return static_cast<bool>(out);
+    }
+
+    // The payload is built whole so the checksum can go in the header in front of it
+    vector<char> payload(binaryCellBytes(layer), '\0');
+    for (uint32_t row = 0; row < map.height; ++row) {
+        memcpy(payload.data() + uint64_t{row} * map.width, map.grid.row(row), map.width);
+    }
+    if (with_planes) {
+        CellMaps maps;
+        buildCellMaps(map, maps);
+        uint64_t cell_words = (layer + 63) / 64;
+        vector<uint64_t> plane(cell_words);
+        for (uint32_t color = 0; color <= map.num_colors; ++color) {
+            uint64_t offset = color * layer + maps.pad;
+            for (uint64_t w = 0; w < cell_words; ++w) {
+                uint64_t at = offset + w * 64, shift = at & 63;
+                uint64_t bits = maps.passable[at >> 6] >> shift;
+                if (shift != 0) {
+                    bits |= maps.passable[(at >> 6) + 1] << (64 - shift);
+                }
+                if (layer - w * 64 < 64) {
+                    bits &= (uint64_t{1} << (layer - w * 64)) - 1;
+                }
+                plane[w] = bits;
+            }
+            char const *bytes = reinterpret_cast<char const *>(plane.data());
+            payload.insert(payload.end(), bytes, bytes + cell_words * 8);
+        }
+    }
+    BinaryHeader header = {};
+    memcpy(header.magic, kBinaryMagic, sizeof header.magic);
+    header.num_colors = map.num_colors;
+    header.height = map.height;
+    header.width = map.width;
+    header.flags = with_planes ? kBinaryPlanes : 0;
+    header.start = map.cellOf(map.start);
+    header.target = map.cellOf(map.target);
+    header.payload_bytes = payload.size();
+    header.checksum = checksumBinary(header, payload.data());
+    out.write(reinterpret_cast<char const *>(&header), sizeof header);
+    out.write(payload.data(), static_cast<streamsize>(payload.size()));
+    return static_cast<bool>(out);
+}
+
+
+
+// Backtrace codes, 3 bits per state. A state reached by pressing a button only
+// stores kButton here; the color it was pressed from lives in a side table
+// since there's at most one press state per button/trap cell.
+enum BacktraceCode : uint64_t {
+    kUndiscovered = 0,
+    kStart,
+    kNorth, // came from the north neighbor
+    kEast,
+    kSouth,
+    kWest,
+    kButton,
+};
+
+// Codes for every (color, row, column) state, indexed by Coord, kept in one of three stores:
+// - kDense: one contiguous array for the whole state space
+// - kLazy: the same array cut into 32 KB pages that are only allocated once a state in
+//   them is discovered, so a color layer the search never enters costs nothing
+// - kSparse: an open addressing hash table of discovered states only, for huge maps
+//   where the search is expected to touch a small scattered part
+class Backtrace {
+public:
+    Backtrace() = default;
+    explicit Backtrace(PuzzleMap const &map) { reset(map); }
+
+    // Every state undiscovered again, sized for map. The dense store keeps its allocation
+    // when it's big enough; the others start out empty.
+    void reset(PuzzleMap const &map, VisitedStore store = VisitedStore::kDense) {
+        mode = store;
+        uint64_t num_words = (map.numStates() + kPerWord - 1) / kPerWord;
+        words.clear();
+        pages.clear();
+        keys.clear();
+        values.clear();
+        if (mode == VisitedStore::kDense) {
+            words.assign(num_words, 0);
+        } else if (mode == VisitedStore::kLazy) {
+            pages.resize((num_words + kPageWords - 1) / kPageWords);
+        } else {
+            keys.assign(kInitialSlots, kEmpty);
+            values.assign(kInitialSlots, 0);
+            used = 0;
+        }
+        pressed_from.clear();
+    }
+
+    VisitedStore store() const { return mode; }
+
+    // The dense store is the hot case, so the other two stay out of line
+    uint64_t code(Coord c) const {
+        if (__builtin_expect(mode != VisitedStore::kDense, 0)) {
+            return storeCode(c);
+        }
+        return (words[c.index / kPerWord] >> shiftOf(c)) & kMask;
+    }
+    bool discovered(Coord c) const { return code(c) != kUndiscovered; }
+
+    void set(Coord c, uint64_t code) {
+        if (__builtin_expect(mode != VisitedStore::kDense, 0)) {
+            storeSet(c, code);
+            return;
+        }
+        uint64_t &word = words[c.index / kPerWord];
+        word = (word & ~(kMask << shiftOf(c))) | (code << shiftOf(c));
+    }
+    // set() with one code for the states [first, end)
+    void fill(uint64_t first, uint64_t end, uint64_t code) {
+        if (mode != VisitedStore::kDense) {
+            for (; first < end; ++first) {
+                set(Coord{first}, code);
+            }
+            return;
+        }
+        for (; first < end && first % kPerWord; ++first) {
+            set(Coord{first}, code);
+        }
+        uint64_t pattern = 0;
+        for (uint64_t i = 0; i < kPerWord; ++i) {
+            pattern |= code << (i * kBits);
+        }
+        for (; first + kPerWord <= end; first += kPerWord) {
+            words[first / kPerWord] = pattern;
+        }
+        for (; first < end; ++first) {
+            set(Coord{first}, code);
+        }
+    }
+    void setButton(Coord c, uint32_t from_color) {
+        set(c, kButton);
+        pressed_from[c.index] = static_cast<uint8_t>(from_color);
+    }
+    // set() for an undiscovered state while other threads write neighboring codes (kDense only)
+    void setAtomic(Coord c, uint64_t code) {
+        __atomic_fetch_or(&words[c.index / kPerWord], code << shiftOf(c), __ATOMIC_RELAXED);
+    }
+    uint32_t pressedFrom(Coord c) const { return pressed_from.at(c.index); }
+
+    // Calls f(index) for every discovered state, in index order except for kSparse
+    template <class F>
+    void forEachDiscovered(F &&f) const {
+        auto scanWords = [&](uint64_t const *first, uint64_t count, uint64_t first_word) {
+            for (uint64_t i = 0; i < count; ++i) {
+                for (uint64_t word = first[i], index = (first_word + i) * kPerWord; word; word >>= kBits, ++index) {
+                    if (word & kMask) f(index);
+                }
+            }
+        };
+        if (mode == VisitedStore::kDense) {
+            scanWords(words.data(), words.size(), 0);
+        } else if (mode == VisitedStore::kLazy) {
+            for (uint64_t p = 0; p < pages.size(); ++p) {
+                if (pages[p]) scanWords(pages[p].get(), kPageWords, p * kPageWords);
+            }
+        } else {
+            for (uint64_t slot = 0; slot < keys.size(); ++slot) {
+                if (keys[slot] != kEmpty) f(keys[slot]);
+            }
+        }
+    }
+
+    // Checkpoint form: the store's own layout (the dense words, the allocated lazy pages
+    // or the sparse table's size and entries), then the press table
+    void save(ostream &out) const {
+        auto put = [&out](uint64_t value) { out.write(reinterpret_cast<char const *>(&value), sizeof value); };
+        auto putWords = [&out](uint64_t const *first, uint64_t count) {
+            out.write(reinterpret_cast<char const *>(first), static_cast<streamsize>(count * sizeof(uint64_t)));
+        };
+        if (mode == VisitedStore::kDense) {
+            put(words.size());
+            putWords(words.data(), words.size());
+        } else if (mode == VisitedStore::kLazy) {
+            put(static_cast<uint64_t>(count_if(pages.begin(), pages.end(), [](auto const &page) { return !!page; })));
+            for (uint64_t p = 0; p < pages.size(); ++p) {
+                if (pages[p]) {
+                    put(p);
+                    putWords(pages[p].get(), kPageWords);
+                }
+            }
+        } else {
+            put(keys.size());
+            put(used);
+            for (uint64_t slot = 0; slot < keys.size(); ++slot) {
+                if (keys[slot] != kEmpty) put(keys[slot] << kBits | values[slot]);
+            }
+        }
+        put(pressed_from.size());
+        for (auto const &[index, color] : pressed_from) {
+            put(index << 8 | color);
+        }
+    }
+    // Reads what save() wrote into a store reset() for the same map and store. False if
+    // the data is cut short or names states past num_states.
+    bool load(istream &in, uint64_t num_states) {
+        auto get = [&in](uint64_t &value) {
+            return static_cast<bool>(in.read(reinterpret_cast<char *>(&value), sizeof value));
+        };
+        auto getWords = [&in](uint64_t *first, uint64_t count) {
+            return static_cast<bool>(in.read(reinterpret_cast<char *>(first), static_cast<streamsize>(count * sizeof(uint64_t))));
+        };
+        uint64_t count = 0;
+        if (!get(count)) return false;
+        if (mode == VisitedStore::kDense) {
+            if (count != words.size() || !getWords(words.data(), count)) return false;
+        } else if (mode == VisitedStore::kLazy) {
+            for (uint64_t i = 0, p = 0; i < count; ++i) {
+                if (!get(p) || p >= pages.size()) return false;
+                pages[p] = make_unique<uint64_t[]>(kPageWords);
+                if (!getWords(pages[p].get(), kPageWords)) return false;
+            }
+        } else {
+            // Same capacity as when saved: entries come in slot order, and putting them into a
+            // smaller table that keeps growing would pile them up into long probe runs
+            uint64_t used_slots = 0;
+            if (count < kInitialSlots || (count & (count - 1)) != 0 || !get(used_slots) || used_slots * 2 > count) {
+                return false;
+            }
+            keys.assign(count, kEmpty);
+            values.assign(count, 0);
+            for (uint64_t i = 0, entry = 0; i < used_slots; ++i) {
+                if (!get(entry) || (entry >> kBits) >= num_states) return false;
+                insert(entry >> kBits, entry & kMask);
+            }
+        }
+        if (!get(count)) return false;
+        for (uint64_t i = 0, entry = 0; i < count; ++i) {
+            if (!get(entry) || (entry >> 8) >= num_states) return false;
+            pressed_from[entry >> 8] = static_cast<uint8_t>(entry & 0xff);
+        }
+        return true;
+    }
+
+    // Memory held for codes right now
+    uint64_t bytes() const {
+        uint64_t total = words.size() * sizeof(uint64_t) + pages.size() * sizeof(pages[0]) +
+                         keys.size() * (sizeof(uint64_t) + sizeof(uint8_t));
+        for (auto const &page : pages) {
+            total += page ? kPageWords * sizeof(uint64_t) : 0;
+        }
+        return total;
+    }
+
+private:
+    static constexpr uint64_t kBits = 3;
+    static constexpr uint64_t kPerWord = 64 / kBits; // 21 codes per word, top bit unused
+    static constexpr uint64_t kMask = (uint64_t{1} << kBits) - 1;
+    static constexpr uint64_t kPageWords = 4096;      // 32 KB, 86016 states
+    static constexpr uint64_t kEmpty = ~uint64_t{0};
+    static constexpr uint64_t kInitialSlots = 1024;
+    static uint64_t shiftOf(Coord c) { return (c.index % kPerWord) * kBits; }
+
+    __attribute__((noinline)) uint64_t storeCode(Coord c) const {
+        uint64_t w = c.index / kPerWord;
+        if (mode == VisitedStore::kLazy) {
+            uint64_t const *page = pages[w / kPageWords].get();
+            return page ? (page[w % kPageWords] >> shiftOf(c)) & kMask : kUndiscovered;
+        }
+        for (uint64_t slot = slotOf(c.index);; slot = (slot + 1) & (keys.size() - 1)) {
+            if (keys[slot] == c.index) return values[slot];
+            if (keys[slot] == kEmpty) return kUndiscovered;
+        }
+    }
+    __attribute__((noinline)) void storeSet(Coord c, uint64_t code) {
+        if (mode == VisitedStore::kSparse) {
+            insert(c.index, code);
+            return;
+        }
+        uint64_t w = c.index / kPerWord;
+        unique_ptr<uint64_t[]> &page = pages[w / kPageWords];
+        if (!page) {
+            page = make_unique<uint64_t[]>(kPageWords); // value-initialized, so all undiscovered
+        }
+        uint64_t &word = page[w % kPageWords];
+        word = (word & ~(kMask << shiftOf(c))) | (code << shiftOf(c));
+    }
+
+    // Fibonacci hashing into a power of two table
+    uint64_t slotOf(uint64_t index) const {
+        return (index * 0x9E3779B97F4A7C15ull) >> (64 - __builtin_ctzll(keys.size()));
+    }
+    void insert(uint64_t index, uint64_t code) {
+        uint64_t slot = slotOf(index);
+        for (; keys[slot] != kEmpty; slot = (slot + 1) & (keys.size() - 1)) {
+            if (keys[slot] == index) {
+                values[slot] = static_cast<uint8_t>(code);
+                return;
+            }
+        }
+        keys[slot] = index;
+        values[slot] = static_cast<uint8_t>(code);
+        if (++used * 2 > keys.size()) {
+            grow();
+        }
+    }
+    void grow() {
+        vector<uint64_t> old_keys = move(keys);
+        vector<uint8_t> old_values = move(values);
+        keys.assign(old_keys.size() * 2, kEmpty);
+        values.assign(old_values.size() * 2, 0);
+        for (uint64_t slot = 0; slot < old_keys.size(); ++slot) {
+            if (old_keys[slot] == kEmpty) continue;
+            uint64_t to = slotOf(old_keys[slot]);
+            while (keys[to] != kEmpty) to = (to + 1) & (keys.size() - 1);
+            keys[to] = old_keys[slot];
+            values[to] = old_values[slot];
+        }
+    }
+
+    VisitedStore mode = VisitedStore::kDense;
+    vector<uint64_t> words;
+    vector<unique_ptr<uint64_t[]>> pages;
+    vector<uint64_t> keys; // state index or kEmpty
+    vector<uint8_t> values;
+    uint64_t used = 0;
+    unordered_map<uint64_t, uint8_t> pressed_from;
+};
+
+// Step from a state back to the state it was discovered from
+Coord previousState(PuzzleMap const &map, Backtrace const &bt, Coord c) {
+    switch (bt.code(c)) {
+        case kNorth: return Coord{c.index - map.width};
+        case kEast: return Coord{c.index + 1};
+        case kSouth: return Coord{c.index + map.width};
+        case kWest: return Coord{c.index - 1};
+        case kButton: return Coord{bt.pressedFrom(c) * map.layerSize() + map.cellOf(c)};
+        default: return c; // kStart; nothing else is ever on a path
+    }
+}
+
+// Path reconstruction into a reusable buffer, target first and start last
+void reconstructPath(PuzzleMap const &map, Backtrace const &bt, Coord target_state, vector<Coord> &path) {
+    path.clear();
+    Coord current = target_state;
+    path.push_back(current);
+// While not start, look at marker in the backtrace
+    while (bt.code(current) != kStart) {
+        current = previousState(map, bt, current);
+        path.push_back(current);
+    }
+}
+
+// Adds one step to a run-length list, extending the last run if it went the same way
+inline void appendMove(vector<MoveRun> &moves, char move) {
+    if (!moves.empty() && moves.back().move == move && isupper(static_cast<unsigned char>(move))) {
+        ++moves.back().count;
+    } else {
+        moves.push_back(MoveRun{move, 1});
+    }
+}
+
+// Move that led into a state with this backtrace code (codes point back, moves go forward)
+char const kForwardMoves[] = {'\0', '\0', 'S', 'W', 'N', 'E'};
+
+// PathFormat::kMoves reconstruction: walks the backtrace like reconstructPath but keeps
+// only the runs, then puts them start first
+void reconstructMoves(PuzzleMap const &map, Backtrace const &bt, Coord target_state, vector<MoveRun> &moves) {
+    moves.clear();
+    for (Coord current = target_state; bt.code(current) != kStart; current = previousState(map, bt, current)) {
+        uint64_t code = bt.code(current);
+        appendMove(moves, code == kButton ? numToChar(map.colorOf(current)) : kForwardMoves[code]);
+    }
+    reverse(moves.begin(), moves.end());
+}
+
+// The same runs from a path of states, start first
+void encodeMoves(PuzzleMap const &map, vector<Coord> const &path, vector<MoveRun> &moves) {
+    moves.clear();
+    for (size_t i = 1; i < path.size(); ++i) {
+        uint64_t from = path[i - 1].index, to = path[i].index;
+        uint32_t color = map.colorOf(path[i]);
+        // North/south first: on a one column map +1 is a step south
+        appendMove(moves, color != map.colorOf(path[i - 1]) ? numToChar(color)
+                          : to + map.width == from ? 'N' : to == from + map.width ? 'S'
+                          : to == from + 1 ? 'E' : 'W');
+    }
+}
+
+// A run as --output moves-binary and the solution cache store it: count << 3 | code, code
+// 0..3 for N, E, S, W, or 4 for a press with the new color's number in place of the count
+uint64_t moveRunCode(MoveRun const &run) {
+    static char const directions[] = "NESW";
+    return isupper(static_cast<unsigned char>(run.move))
+        ? (run.count << 3) | static_cast<uint64_t>(strchr(directions, run.move) - directions)
+        : (uint64_t{charToNum(run.move)} << 3) | 4;
+}
+
+// LEB128: seven bits a byte, low bits first, the top bit set on all but the last
+void appendVarint(string &out, uint64_t value) {
+    for (; value >= 0x80; value >>= 7) {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+    }
+    out += static_cast<char>(value);
+}
+
+uint64_t SolveResult::pathLength() const {
+    if (moves.empty()) {
+        return path.size();
+    }
+    uint64_t states = 1;
+    for (MoveRun const &run : moves) {
+        states += run.count;
+    }
+    return states;
+}
+
+
+
+
+
+// Writes finished output chunks with as few calls as possible: straight to stdout's fd
+// with writev when rendering for cout, plain writes into any other stream (batch records)
+void writeChunks(ostream &out, string const *chunks, size_t count) {
+    if (&out != &cout) {
+        for (size_t i = 0; i < count; ++i) {
+            out.write(chunks[i].data(), static_cast<streamsize>(chunks[i].size()));
+        }
+        return;
+    }
+    out.flush();
+    vector<iovec> pieces;
+    for (size_t i = 0; i < count; ++i) {
+        if (!chunks[i].empty()) {
+            pieces.push_back(iovec{const_cast<char *>(chunks[i].data()), chunks[i].size()});
+        }
+    }
+    size_t next = 0;
+    while (next < pieces.size()) {
+        int batch = static_cast<int>(min<size_t>(pieces.size() - next, IOV_MAX));
+        ssize_t written = writev(STDOUT_FILENO, &pieces[next], batch);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            out.setstate(ios_base::badbit);
+            return;
+        }
+        // Skip what got written, a short write resumes mid-chunk
+        size_t left = static_cast<size_t>(written);
+        while (next < pieces.size() && left >= pieces[next].iov_len) {
+            left -= pieces[next].iov_len;
+            ++next;
+        }
+        if (left > 0) {
+            pieces[next].iov_base = static_cast<char *>(pieces[next].iov_base) + left;
+            pieces[next].iov_len -= left;
+        }
+    }
+}
+
+// Flush the list buffer once it gets this big
+constexpr size_t kListChunk = size_t{1} << 20;
+
+void generateListOutput(PuzzleMap const &map, SolveResult const &result, ostream &out) {
+    // Print path from start to goal
+    string chunk;
+    chunk.reserve(kListChunk + 64);
+    for (Coord c : result.path) {
+        char line[64];
+        char *end = line;
+        *end++ = '(';
+        *end++ = numToChar(map.colorOf(c));
+        *end++ = ',';
+        *end++ = ' ';
+        *end++ = '(';
+        end = to_chars(end, end + 20, map.rowOf(c)).ptr;
+        *end++ = ',';
+        *end++ = ' ';
+        end = to_chars(end, end + 20, map.columnOf(c)).ptr;
+        *end++ = ')';
+        *end++ = ')';
+        *end++ = '\n';
+        chunk.append(line, end);
+        if (chunk.size() >= kListChunk) {
+            writeChunks(out, &chunk, 1);
+            chunk.clear();
+        }
+    }
+    writeChunks(out, &chunk, 1);
+}
+
+void generateMovesOutput(PuzzleMap const &map, SolveResult const &result, bool binary, ostream &out) {
+    vector<MoveRun> encoded;
+    if (result.moves.empty()) {
+        encodeMoves(map, result.path, encoded);
+    }
+    vector<MoveRun> const &moves = result.moves.empty() ? encoded : result.moves;
+    string chunk;
+    chunk.reserve(kListChunk + 64);
+    if (binary) {
+        auto put = [&](uint64_t value, int bytes) {
+            for (int i = 0; i < bytes; ++i, value >>= 8) {
+                chunk += static_cast<char>(value & 0xff);
+            }
+        };
+        chunk.append("PZLMOV01");
+        put(map.rowOf(map.start), 4);
+        put(map.columnOf(map.start), 4);
+        put(moves.size(), 8);
+        for (MoveRun const &run : moves) {
+            appendVarint(chunk, moveRunCode(run));
+            if (chunk.size() >= kListChunk) {
+                writeChunks(out, &chunk, 1);
+                chunk.clear();
+            }
+        }
+        writeChunks(out, &chunk, 1);
+        return;
+    }
+
+    char line[64];
+    char *end = line;
+    *end++ = '(';
+    *end++ = numToChar(map.colorOf(map.start));
+    *end++ = ',';
+    *end++ = ' ';
+    *end++ = '(';
+    end = to_chars(end, end + 20, map.rowOf(map.start)).ptr;
+    *end++ = ',';
+    *end++ = ' ';
+    end = to_chars(end, end + 20, map.columnOf(map.start)).ptr;
+    *end++ = ')';
+    *end++ = ')';
+    *end++ = '\n';
+    chunk.append(line, end);
+    for (size_t i = 0; i < moves.size(); ++i) {
+        end = line;
+        if (moves[i].count > 1) {
+            end = to_chars(end, end + 20, moves[i].count).ptr;
+        }
+        *end++ = moves[i].move;
+        *end++ = i + 1 == moves.size() || i % 64 == 63 ? '\n' : ' ';
+        chunk.append(line, end);
+        if (chunk.size() >= kListChunk) {
+            writeChunks(out, &chunk, 1);
+            chunk.clear();
+        }
+    }
+    writeChunks(out, &chunk, 1);
+}
+
+// Map output char for a cell that is not on the solution path
+char offPathChar(char original, uint32_t color) {
+    char output = original;
+    if(original == '@' && color != 0) {output = '@';}
+// Not on solution path - replace buttons and doors with '.'
+    if ((islower(original) || original == '^') && charToNum(original) == color) {
+        output = '.';
+    } else if (isupper(original) && charToNum(original) == color) {
+        output = '.';
+    } else if(original == '@') {
+        output = '.';
+    }
+    return output;
+}
+
+// Map output char for a state on the solution path; pressed if the path got to this
+// state by pressing the button under it
+char onPathChar(char original, uint32_t color, bool pressed) {
+    char output = original;
+// If map coord on solution path, mark '+' or smth
+    if(original == '@' && color != 0) {output = '+';}
+    if (original == '.' || (original == toupper(numToChar(color)) && original != '^')) {
+        output = '+';
+// If button
+    } else if (islower(original)) {
+        // A button in its own color map is where the path either pressed it or walked
+        // onto it already in that color; the old char backtrace never matched the button
+        // letter in either case, so it always shows as @
+        if (color == charToNum(original)) {
+            output = '@';
+        } else {
+            output = '%';
+        }
+    }
+    // Keep @ for start (only on color ^)
+    if (original == '@' && color == 0) {
+        output = '@';//
+    }
+    // Always show target
+    if (original == '?') {
+        output = '?';
+    }
+// handle trapped buttons
+    if (original == '^') {
+        if (color == charToNum('^')) {
+            // Only show @ if actually pressed the trap
+            if (pressed) {
+                output = '@';
+            } else {
+                output = '+';
+            }
+
+        } else {
+            output = '%';
+        }
+    }
+    return output;
+}
+
+// Renders one color layer ("// color x" and height rows) into buf: every row goes through
+// a per-layer translation table, then the path states in this layer (path holds state
+// index and output char, sorted by index) are patched in
+void renderLayer(PuzzleMap const &map, uint32_t color, vector<pair<uint64_t, char>> const &path, string &buf) {
+    char table[256] = {};
+    for (int c = 0; c < 256; ++c) {
+        if (isValidChar(static_cast<char>(c), map.num_colors)) {
+            table[c] = offPathChar(static_cast<char>(c), color);
+        }
+    }
+
+    uint64_t line = uint64_t{map.width} + 1;
+    buf.assign("// color ");
+    buf += numToChar(color);
+    buf += '\n';
+    size_t header = buf.size();
+    buf.resize(header + map.height * line);
+    char *rows = &buf[header];
+    for (uint32_t row = 0; row < map.height; ++row) {
+        char const *src = map.grid.row(row);
+        char *dst = rows + row * line;
+        for (uint32_t col = 0; col < map.width; ++col) {
+            dst[col] = table[static_cast<unsigned char>(src[col])];
+        }
+        dst[map.width] = '\n';
+    }
+
+    uint64_t layer = map.layerSize();
+    auto first = lower_bound(path.begin(), path.end(), make_pair(color * layer, '\0'));
+    for (auto it = first; it != path.end() && it->first < (color + 1) * layer; ++it) {
+        uint64_t cell = it->first - color * layer;
+        rows[(cell / map.width) * line + cell % map.width] = it->second;
+    }
+}
+
+// Maps smaller than this (cells per layer) aren't worth waking threads for
+constexpr uint64_t kParallelRenderCells = uint64_t{1} << 18;
+
+// Renders the color layers in groups of render_threads, one layer per worker, and writes
+// each group out with a single writeChunks call
+void generateMapOutput(PuzzleMap const &map, SolveResult const &result, unsigned render_threads,
+                       ostream &out) {
+// Output char of every path state, sorted so each layer finds its states with one binary search
+    vector<pair<uint64_t, char>> path;
+    path.reserve(result.path.size());
+    for (size_t i = 0; i < result.path.size(); ++i) {
+        Coord state = result.path[i];
+        uint32_t color = map.colorOf(state);
+        bool pressed = i > 0 && map.colorOf(result.path[i - 1]) != color;
+        path.emplace_back(state.index, onPathChar(map.cellAt(state), color, pressed));
+    }
+    sort(path.begin(), path.end());
+
+    uint32_t layers = map.num_colors + 1;
+    unsigned workers = map.layerSize() >= kParallelRenderCells ? min(max(render_threads, 1u), layers) : 1;
+    vector<string> chunks(workers);
+    if (workers == 1) {
+        for (uint32_t color = 0; color < layers; ++color) {
+            renderLayer(map, color, path, chunks[0]);
+            writeChunks(out, chunks.data(), 1);
+        }
+        return;
+    }
+
+    WorkerPool pool(workers);
+    for (uint32_t first = 0; first < layers; first += workers) {
+        uint32_t count = min(workers, layers - first);
+        pool.run([&](unsigned worker) {
+            if (worker < count) {
+                renderLayer(map, first + worker, path, chunks[worker]);
+            }
+        });
+        writeChunks(out, chunks.data(), count);
+    }
+}
+
+void printNoSolutionOutput(const PuzzleMap& map, const SolveResult& result, ostream &out) {
+    string buf = "No solution.\nDiscovered:\n";
+    buf.reserve(buf.size() + map.height * (uint64_t{map.width} + 1));
+
+    // Print the map with undiscovered locations as '#'
+    for (uint64_t row = 0, cell = 0; row < map.height; ++row) {
+        char const *src = map.grid.row(row);
+        for (uint32_t col = 0; col < map.width; ++col, ++cell) {
+            // Print original character if discovered in any color, '#' otherwise
+            buf += result.discoveredCell(cell) ? src[col] : '#';
+        }
+        buf += '\n';
+    }
+    writeChunks(out, &buf, 1);
+}
+
+
+
+// Backtrace code pointing back the way we came, for moves in N, E, S, W order
+uint64_t const kBackCodes[4] = {kSouth, kWest, kNorth, kEast};
+
+// Index offset of a move in N, E, S, W order
+inline int64_t moveOffset(PuzzleMap const &map, int dir) {
+    int64_t const offsets[4] = {-static_cast<int64_t>(map.width), 1, static_cast<int64_t>(map.width), -1};
+    return offsets[dir];
+}
+
+// Whether a cell holding c can be stepped onto in color; the same rules buildCellMaps
+// turns into the passable bitmap, for the searches that read the grid directly
+inline bool passableIn(char c, uint32_t color) {
+    if (c == '.' || c == '?' || c == '^' || islower(c)) {
+        return true;
+    }
+    if (c == '@') {
+        return color != 0;
+    }
+    return isupper(c) && charToNum(c) == color;
+}
+
+// Passable, undiscovered neighbors of a state as a 4-bit N/E/S/W mask. One bit test per
+// direction with out-of-grid probes masked off instead of branched around. kAtomic reads
+// `open` with relaxed atomic loads for when other threads are clearing bits in it.
+template <bool kAtomic = false>
+inline uint64_t openNeighbors(PuzzleMap const &map, CellMaps const &maps, vector<uint64_t> const &open,
+                              Coord state, uint64_t cell, uint32_t color) {
+    auto test = [&open](uint64_t i) { return kAtomic ? testBitAtomic(open, i) : testBit(open, i); };
+    uint64_t bit = state.index + maps.pad;
+    uint64_t candidates =
+          (test(bit - map.width) & (cell >= map.width))
+        | (test(bit + 1) & testBit(maps.has_east, cell)) << 1
+        | (test(bit + map.width) & (cell + map.width < map.layerSize())) << 2
+        | (test(bit - 1) & testBit(maps.has_west, cell)) << 3;
+
+    // Doors of the current color are closed while standing on a ^
+    if (testBit(maps.traps, cell)) {
+        for (int dir = 0; dir < 4; ++dir) {
+            char n = map.grid[cell + moveOffset(map, dir) * static_cast<int64_t>((candidates >> dir) & 1)];
+            if (isupper(n) && charToNum(n) == color) {
+                candidates &= ~(uint64_t{1} << dir);
+            }
+        }
+    }
+    return candidates;
+}
+
+// The searches are templates over their stats type: SearchStats with --stats, otherwise
+// NoStats, whose hooks are empty so normal runs carry no counting code at all.
+struct NoStats {
+    void expand(uint32_t) {}
+    void press(uint32_t) {}
+    void container(uint64_t) {}
+    void merge(NoStats const &) {}
+};
+
+// Why a single-threaded search would stop early: SolveOptions::cancel or the time_limit
+// deadline. Polled once every 4096 states expanded, which is also when progress gets
+// reported. A stopped search just returns false; Solver::solve sorts it out. Every loop
+// that expands states has to poll it, or solvePortfolio waits on a loser that can't
+// hear it has lost.
+struct StopCheck {
+    atomic<bool> const *cancel = nullptr;
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max();
+    function<void(uint64_t, uint64_t)> const *progress = nullptr;
+    uint64_t bound = 0; // passed to progress
+    chrono::steady_clock::time_point next_report{};
+    bool timed_out = false;
+
+    bool operator()(uint64_t expanded) {
+        if ((expanded & 4095) != 0) {
+            return false;
+        }
+        if (cancel && cancel->load(memory_order_relaxed)) {
+            return true;
+        }
+        if (!progress && deadline == chrono::steady_clock::time_point::max()) {
+            return false;
+        }
+        auto now = chrono::steady_clock::now();
+        if (progress && *progress && now >= next_report) {
+            (*progress)(expanded, bound);
+            next_report = now + chrono::seconds(1);
+        }
+        return timed_out = now >= deadline;
+    }
+};
+
+// Array of state indices in an anonymous mapping grown with mremap, so doubling it never
+// copies what's in it and only the pages actually written ever take memory
+class StateArray {
+public:
+    StateArray() = default;
+    StateArray(StateArray const &) = delete;
+    StateArray &operator=(StateArray const &) = delete;
+    ~StateArray() {
+        if (slots) {
+            munmap(slots, count * sizeof(uint64_t));
+        }
+    }
+
+    uint64_t *data() const { return slots; }
+    uint64_t size() const { return count; }
+
+    // Grows to at least wanted slots, keeping the contents; throws bad_alloc like a vector
+    void grow(uint64_t wanted) {
+        if (wanted <= count) {
+            return;
+        }
+        void *mapped = slots ? mremap(slots, count * sizeof(uint64_t), wanted * sizeof(uint64_t), MREMAP_MAYMOVE)
+                             : mmap(nullptr, wanted * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED) {
+            throw bad_alloc();
+        }
+        slots = static_cast<uint64_t *>(mapped);
+        count = wanted;
+    }
+
+private:
+    uint64_t *slots = nullptr;
+    uint64_t count = 0;
+};
+
+// Search containers over one StateArray. reset() sizes it from the state-space bound
+// (every state is pushed at most once) up to kInitialSlots; past that it doubles, out of
+// line, when full. The Solver keeps them between solves, so repeated solves don't
+// allocate at all. FrontierQueue pops the oldest state (BFS, as a power-of-two ring),
+// FrontierStack the newest (DFS); searchFrontier is built once for each.
+uint64_t const kInitialSlots = uint64_t{1} << 16;
+
+class FrontierQueue {
+public:
+    void reset(uint64_t bound) {
+        head = tail = 0;
+        uint64_t wanted = 512; // a page
+        while (wanted < min(bound, kInitialSlots)) {
+            wanted *= 2;
+        }
+        slots.grow(wanted);
+        mask = slots.size() - 1;
+    }
+    bool empty() const { return head == tail; }
+    uint64_t size() const { return tail - head; }
+    void push(Coord c) {
+        if (__builtin_expect(tail - head > mask, 0)) {
+            grow();
+        }
+        slots.data()[tail++ & mask] = c.index;
+    }
+    Coord pop() { return Coord{slots.data()[head++ & mask]}; }
+    // Calls f(index) for every waiting state, the next one to pop first
+    template <class F>
+    void forEach(F &&f) const {
+        for (uint64_t i = head; i != tail; ++i) f(slots.data()[i & mask]);
+    }
+
+private:
+    // Doubles; states that had wrapped around to the front move to just past the old end
+    __attribute__((noinline)) void grow() {
+        uint64_t old_size = slots.size();
+        slots.grow(old_size * 2);
+        uint64_t first = head & mask;
+        memcpy(slots.data() + old_size, slots.data(), first * sizeof(uint64_t));
+        head = first;
+        tail = first + old_size;
+        mask = slots.size() - 1;
+    }
+
+    StateArray slots;
+    uint64_t mask = 0; // slots.size() - 1
+    uint64_t head = 0; // both only ever grow; a state's slot is i & mask
+    uint64_t tail = 0;
+};
+
+class FrontierStack {
+public:
+    void reset(uint64_t bound) {
+        top = 0;
+        slots.grow(max<uint64_t>(512, min(bound, kInitialSlots)));
+    }
+    bool empty() const { return top == 0; }
+    uint64_t size() const { return top; }
+    void push(Coord c) {
+        if (__builtin_expect(top == slots.size(), 0)) {
+            grow();
+        }
+        slots.data()[top++] = c.index;
+    }
+    Coord pop() { return Coord{slots.data()[--top]}; }
+    // Calls f(index) for every waiting state, the last one to pop first, so pushing them
+    // back in this order rebuilds the stack
+    template <class F>
+    void forEach(F &&f) const {
+        for (uint64_t i = 0; i < top; ++i) f(slots.data()[i]);
+    }
+
+private:
+    __attribute__((noinline)) void grow() { slots.grow(slots.size() * 2); }
+
+    StateArray slots;
+    uint64_t top = 0;
+};
+
+// Breadth first (FrontierQueue) or depth first (FrontierStack) search. Returns true and
+// sets solution_state if the target was discovered. With resume, sc, btrace and open
+// already hold a stopped search (see readCheckpoint) and it carries on from there.
+template <class Frontier, class Stats>
+bool searchFrontier(Backtrace& btrace, PuzzleMap const &map, CellMaps const &maps, Frontier &sc,
+                    vector<uint64_t> &open, Coord &solution_state, uint64_t &expanded, bool resume,
+                    StopCheck &stop, Stats &stats) {
+    uint64_t const layer = map.layerSize();
+    uint64_t const target_cell = map.target.index;
+    // Passable and not yet discovered; cleared as states get discovered so a neighbor
+    // check is a single bit test. This is maps.passable itself, handed over by the caller
+    // instead of copied, since nothing needs passable after the search.
+    if (!resume) {
+        sc.reset(map.numStates());
+
+        // Initialize start
+        sc.push(map.start);
+        btrace.set(map.start, kStart);
+        clearBit(open, map.start.index + maps.pad);
+    }
+
+    // While loop
+    while(!sc.empty()) {
+        // Checked before the pop so a stopped search leaves its whole frontier behind
+        if (stop(expanded + 1)) {
+            return false;
+        }
+        Coord current_state = sc.pop();
+        ++expanded;
+
+        uint32_t color = map.colorOf(current_state);
+        uint64_t cell = current_state.index - color * layer;
+        stats.expand(color);
+
+        // If its a button/^ AND we're in a color state other than button color
+        if (testBit(maps.buttons, cell) && charToNum(map.grid[cell]) != color) {
+            uint32_t new_color = charToNum(map.grid[cell]);
+            Coord button_state{new_color * layer + cell};
+            // If where the button leads to is undiscovered (buttons are passable in every color)
+            if (testBit(open, button_state.index + maps.pad)) {
+                // Add that undiscovered spot to search container
+                clearBit(open, button_state.index + maps.pad);
+                btrace.setButton(button_state, color);
+                sc.push(button_state);
+                stats.press(new_color);
+                stats.container(sc.size());
+            }
+            continue;  // Skip adjacent checks after button press
+        }
+        // Check finish
+        else if (cell == target_cell) {
+            solution_state = current_state;
+            return true;
+        } 
+
+        // Check adjacent locations
+        uint64_t candidates = openNeighbors(map, maps, open, current_state, cell, color);
+        while (candidates) {
+            int dir = __builtin_ctzll(candidates);
+            candidates &= candidates - 1;
+            Coord next{current_state.index + moveOffset(map, dir)};
+            clearBit(open, next.index + maps.pad);
+            btrace.set(next, kBackCodes[dir]);
+            sc.push(next);
+
+            if (cell + moveOffset(map, dir) == target_cell) {
+                solution_state = next;
+                return true;
+            }
+        }
+        stats.container(sc.size());
+    }
+    return false;
+}
+
+// States that can walk to the target inside their own color layer without pressing
+// anything. A layer is flood filled backwards from the target the first time it's asked
+// about, into a bitmap of its own, so layers the search never enters cost nothing.
+class TargetReach {
+public:
+    TargetReach(PuzzleMap const &map, CellMaps const &maps) : map(map), maps(maps), layers(map.num_colors + 1) {}
+
+    bool reaches(uint32_t color, uint64_t cell) {
+        if (layers[color].empty()) {
+            fillLayer(color);
+        }
+        return testBit(layers[color], cell);
+    }
+
+private:
+    void fillLayer(uint32_t color) {
+        vector<uint64_t> &bits = layers[color];
+        bits.assign((map.layerSize() + 63) / 64, 0);
+        vector<uint64_t> cells{map.target.index};
+        setBit(bits, map.target.index);
+        while (!cells.empty()) {
+            uint64_t cell = cells.back();
+            cells.pop_back();
+            bool in_bounds[4] = {cell >= map.width, testBit(maps.has_east, cell) != 0,
+                                 cell + map.width < map.layerSize(), testBit(maps.has_west, cell) != 0};
+            for (int dir = 0; dir < 4; ++dir) {
+                uint64_t from = cell + moveOffset(map, dir);
+                if (!in_bounds[dir] || testBit(bits, from)) {
+                    continue;
+                }
+                // Standing on another color's button forces a press, so no walking on from it
+                if (testBit(maps.buttons, from) && charToNum(map.grid[from]) != color) {
+                    continue;
+                }
+                setBit(bits, from);
+                // Only keep going backwards through cells that can be stepped onto. Read off
+                // the grid, since the search has maps.passable as its open bitmap; the only
+                // difference is pruned pockets, which hang off one cell and lead nowhere.
+                if (passableIn(map.grid[from], color)) {
+                    cells.push_back(from);
+                }
+            }
+        }
+    }
+
+    PuzzleMap const &map;
+    CellMaps const &maps;
+    vector<vector<uint64_t>> layers; // per color, one bit per cell; empty until filled
+};
+
+// A* over the same state graph where every move and every press costs 1.
+// h = Manhattan distance to the target, plus 1 if the target can't be walked to inside
+// the current color (at least one more press is needed). That bound is consistent, so
+// a state's first pop is at its shortest distance and f grows by at most 3 per edge
+// (a step away from the target onto a cell that can't walk there), which lets four
+// rotating buckets stand in for a binary heap. The backtrace is written
+// when a state is popped rather than when it's pushed, so a state may sit in the
+// buckets more than once but only its best entry is ever used. Like searchFrontier it
+// takes maps.passable over as `open` instead of copying it.
+template <class Stats>
+bool searchAStar(Backtrace& btrace, PuzzleMap const &map, CellMaps const &maps, vector<uint64_t> &open,
+                 Coord &solution_state, uint64_t &expanded, StopCheck &stop, Stats &stats) {
+    // Bucket entries pack the state index with its backtrace code (bits 56-58) and the
+    // color a press came from (bits 59-63); g is recovered as f - h when popped
+    uint64_t const kIndexMask = (uint64_t{1} << 56) - 1;
+    auto pack = [](Coord state, uint64_t code, uint64_t from_color) {
+        return state.index | code << 56 | from_color << 59;
+    };
+
+    uint64_t const layer = map.layerSize();
+    uint64_t const target_cell = map.target.index;
+    uint64_t const target_row = target_cell / map.width;
+    uint64_t const target_column = target_cell % map.width;
+    TargetReach reach(map, maps);
+    auto heuristic = [&](Coord state) {
+        uint32_t color = map.colorOf(state);
+        uint64_t cell = state.index - color * layer;
+        uint64_t row = cell / map.width, column = cell % map.width;
+        uint64_t distance = (row > target_row ? row - target_row : target_row - row) +
+                            (column > target_column ? column - target_column : target_column - column);
+        return distance + (reach.reaches(color, cell) ? 0 : 1);
+    };
+
+    // Cleared when a state is popped for good
+    setBit(open, map.start.index + maps.pad);
+
+    vector<uint64_t> buckets[4];
+    uint64_t f = heuristic(map.start);
+    buckets[f % 4].push_back(pack(map.start, kStart, 0));
+    size_t queued = 1;
+
+    while (queued > 0) {
+        while (buckets[f % 4].empty()) {
+            ++f;
+        }
+        uint64_t entry = buckets[f % 4].back();
+        buckets[f % 4].pop_back();
+        --queued;
+
+        Coord current_state{entry & kIndexMask};
+        if (!testBit(open, current_state.index + maps.pad)) {
+            continue; // Already popped with a shorter distance
+        }
+        clearBit(open, current_state.index + maps.pad);
+        uint64_t code = (entry >> 56) & 7;
+        if (code == kButton) {
+            btrace.setButton(current_state, static_cast<uint32_t>(entry >> 59));
+        } else {
+            btrace.set(current_state, code);
+        }
+        if (stop(++expanded)) {
+            return false;
+        }
+
+        uint32_t color = map.colorOf(current_state);
+        uint64_t cell = current_state.index - color * layer;
+        stats.expand(color);
+        if (cell == target_cell) {
+            solution_state = current_state;
+            return true;
+        }
+
+        uint64_t g = f - heuristic(current_state);
+        auto push = [&](Coord next, uint64_t next_code, uint64_t from_color) {
+            buckets[(g + 1 + heuristic(next)) % 4].push_back(pack(next, next_code, from_color));
+            ++queued;
+        };
+
+        // Standing on another color's button presses it
+        if (testBit(maps.buttons, cell) && charToNum(map.grid[cell]) != color) {
+            Coord button_state{charToNum(map.grid[cell]) * layer + cell};
+            if (testBit(open, button_state.index + maps.pad)) {
+                push(button_state, kButton, color);
+                stats.press(map.colorOf(button_state));
+                stats.container(queued);
+            }
+            continue;
+        }
+
+        uint64_t candidates = openNeighbors(map, maps, open, current_state, cell, color);
+        while (candidates) {
+            int dir = __builtin_ctzll(candidates);
+            candidates &= candidates - 1;
+            push(Coord{current_state.index + moveOffset(map, dir)}, kBackCodes[dir], 0);
+        }
+        stats.container(queued);
+    }
+    return false;
+}
+
+// Level-by-level BFS from map.start and backwards from every color's '?' state at once,
+// always growing the smaller frontier. The backward side walks the reversed edges:
+// - a move (c, x) -> (c, y) needs y passable in c, x not another color's button (standing
+//   there forces a press) and, if x is a ^, y not a door of c
+// - a press (j, x) -> (k, x) exists for every j != k when x is a button of color k, so
+//   backward from (k, x) every other layer at x is a predecessor
+// Both sides check the other's discovered set as they generate states. Levels were
+// disjoint until then, so the first state found by both is on a shortest path. The
+// backward codes point toward the target and get copied into btrace along the spliced
+// path so the normal map/list output can walk it back from the '?' state.
+template <class Stats>
+bool searchBidirectional(Backtrace& btrace, PuzzleMap const &map, CellMaps const &maps,
+                         Coord &solution_state, uint64_t &expanded, StopCheck &stop, Stats &stats) {
+    uint64_t const layer = map.layerSize();
+    // Forward: passable and undiscovered. The backward side is kept in the same kind of
+    // store as btrace and only checks passability against maps.passable.
+    vector<uint64_t> open_forward = maps.passable;
+    Backtrace towards_target; // kStart marks a '?' state, kButton a press, else the move taken
+    towards_target.reset(map, btrace.store());
+
+    vector<uint64_t> forward{map.start.index}, backward, next_level;
+    btrace.set(map.start, kStart);
+    clearBit(open_forward, map.start.index + maps.pad);
+    for (uint32_t color = 0; color <= map.num_colors; ++color) {
+        Coord goal{color * layer + map.target.index};
+        towards_target.set(goal, kStart);
+        backward.push_back(goal.index);
+    }
+
+    auto buttonColor = [&](uint64_t cell) { return charToNum(map.grid[cell]); };
+
+    // Copy the backward codes from the meeting state on to the target into btrace
+    auto splice = [&](Coord meet) {
+        Coord current = meet;
+        while (towards_target.code(current) != kStart) {
+            uint64_t code = towards_target.code(current);
+            uint32_t color = map.colorOf(current);
+            uint64_t cell = current.index - color * layer;
+            if (code == kButton) {
+                Coord next{buttonColor(cell) * layer + cell};
+                btrace.setButton(next, color);
+                current = next;
+            } else {
+                int dir = static_cast<int>(code - kNorth);
+                Coord next{current.index + moveOffset(map, dir)};
+                btrace.set(next, kBackCodes[dir]);
+                current = next;
+            }
+        }
+        solution_state = current;
+        return true;
+    };
+
+    // Expand one forward state, returns true if it touched the backward side
+    auto expandForward = [&](Coord current_state) {
+        uint32_t color = map.colorOf(current_state);
+        uint64_t cell = current_state.index - color * layer;
+        stats.expand(color);
+        if (testBit(maps.buttons, cell) && buttonColor(cell) != color) {
+            Coord button_state{buttonColor(cell) * layer + cell};
+            if (testBit(open_forward, button_state.index + maps.pad)) {
+                clearBit(open_forward, button_state.index + maps.pad);
+                btrace.setButton(button_state, color);
+                stats.press(buttonColor(cell));
+                if (towards_target.discovered(button_state)) {
+                    return splice(button_state);
+                }
+                next_level.push_back(button_state.index);
+            }
+            return false;
+        }
+        uint64_t candidates = openNeighbors(map, maps, open_forward, current_state, cell, color);
+        while (candidates) {
+            int dir = __builtin_ctzll(candidates);
+            candidates &= candidates - 1;
+            Coord next{current_state.index + moveOffset(map, dir)};
+            clearBit(open_forward, next.index + maps.pad);
+            btrace.set(next, kBackCodes[dir]);
+            if (towards_target.discovered(next)) {
+                return splice(next);
+            }
+            next_level.push_back(next.index);
+        }
+        return false;
+    };
+
+    // Expand one backward state, returns true if it touched the forward side
+    auto expandBackward = [&](Coord current_state) {
+        uint32_t color = map.colorOf(current_state);
+        uint64_t cell = current_state.index - color * layer;
+        stats.expand(color);
+        auto reach = [&](Coord previous, uint64_t code) {
+            towards_target.set(previous, code);
+            if (btrace.discovered(previous)) {
+                return splice(previous);
+            }
+            next_level.push_back(previous.index);
+            return false;
+        };
+
+        // Pressed here from any other color
+        if (testBit(maps.buttons, cell) && buttonColor(cell) == color) {
+            for (uint32_t from = 0; from <= map.num_colors; ++from) {
+                Coord previous{from * layer + cell};
+                // Buttons can be stood on in every color
+                if (from != color && !towards_target.discovered(previous)) {
+                    stats.press(color);
+                    if (reach(previous, kButton)) {
+                        return true;
+                    }
+                }
+            }
+        }
+        // Walked here from a neighbor, only possible if this cell can be stepped onto
+        if (!testBit(maps.passable, current_state.index + maps.pad)) {
+            return false;
+        }
+        bool is_own_door = isupper(map.grid[cell]) && charToNum(map.grid[cell]) == color;
+        bool in_bounds[4] = {cell >= map.width, testBit(maps.has_east, cell) != 0,
+                             cell + map.width < layer, testBit(maps.has_west, cell) != 0};
+        for (int dir = 0; dir < 4; ++dir) {
+            if (!in_bounds[dir]) {
+                continue;
+            }
+            uint64_t from = cell + moveOffset(map, dir);
+            Coord previous{current_state.index + moveOffset(map, dir)};
+            // The start is the one state that can be stood on without being passable
+            bool can_stand = testBit(maps.passable, previous.index + maps.pad) || previous.index == map.start.index;
+            if (!can_stand || towards_target.discovered(previous)) {
+                continue;
+            }
+            if (testBit(maps.buttons, from) && buttonColor(from) != color) {
+                continue; // would have had to press instead
+            }
+            if (is_own_door && testBit(maps.traps, from)) {
+                continue; // doors are shut while standing on a ^
+            }
+            // previous is in direction dir from here, so its move is the opposite way
+            if (reach(previous, kBackCodes[dir])) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    while (!forward.empty() && !backward.empty()) {
+        stats.container(forward.size() + backward.size());
+        bool grow_forward = forward.size() <= backward.size();
+        vector<uint64_t> &frontier = grow_forward ? forward : backward;
+        next_level.clear();
+        for (uint64_t index : frontier) {
+            if (stop(++expanded)) {
+                return false;
+            }
+            if (grow_forward ? expandForward(Coord{index}) : expandBackward(Coord{index})) {
+                return true;
+            }
+        }
+        frontier.swap(next_level);
+    }
+
+    // No path. Finish the forward side anyway so the Discovered report is complete.
+    while (!forward.empty()) {
+        stats.container(forward.size());
+        next_level.clear();
+        for (uint64_t index : forward) {
+            if (stop(++expanded)) {
+                return false;
+            }
+            expandForward(Coord{index});
+        }
+        forward.swap(next_level);
+    }
+    return false;
+}
+
+// Level-synchronous BFS with the frontier split into one contiguous slice per worker.
+// Each level runs in three passes:
+// 1. expand: workers claim newly discovered states by atomically clearing their bit in
+//    `open` and collect them in their own next-level list
+// 2. parents: for every claimed state, pick its parent as the first predecessor in N, E, S,
+//    W, then press-color order that already has a backtrace code. Every predecessor with a
+//    code must be in the current level (an older one would have claimed the state
+//    earlier), and this level's codes aren't written until pass 3. So the backtrace only
+//    depends on which level each state landed in, never on which thread won a claim, and
+//    the output is the same for any number of threads.
+// 3. merge: each worker writes its codes and copies its list into the next frontier at an
+//    offset from a prefix sum over the list sizes; no lock involved.
+// Small levels run all three passes on the calling thread without atomics.
+template <class Stats>
+bool searchParallel(Backtrace& btrace, PuzzleMap const &map, CellMaps const &maps, unsigned num_threads,
+                    Coord &solution_state, uint64_t &expanded, Stats &stats) {
+    size_t const kParallelLevel = 4096;
+    uint64_t const layer = map.layerSize();
+    uint64_t const target_cell = map.target.index;
+    uint64_t const kNotFound = ~uint64_t{0};
+    uint8_t const kPressedFrom = 8; // parent codes at or above this are a press from (code - 8)
+
+    vector<uint64_t> open = maps.passable;
+    vector<uint64_t> frontier{map.start.index}, next_frontier;
+    btrace.set(map.start, kStart);
+
+    WorkerPool pool(num_threads);
+    vector<vector<uint64_t>> claimed(num_threads);
+    vector<vector<uint8_t>> parents(num_threads);
+    vector<vector<pair<uint64_t, uint32_t>>> presses(num_threads);
+    vector<uint64_t> found(num_threads, kNotFound);
+    vector<size_t> offsets(num_threads + 1, 0);
+    vector<Stats> worker_stats(num_threads);
+    unsigned workers = 1; // for the current level
+
+    auto sliceOf = [&](vector<uint64_t> const &states, unsigned worker) {
+        size_t chunk = (states.size() + workers - 1) / workers;
+        size_t begin = min(states.size(), worker * chunk);
+        return make_pair(begin, min(states.size(), begin + chunk));
+    };
+    auto claim = [&](uint64_t index) {
+        if (workers > 1) {
+            return claimBit(open, index + maps.pad);
+        }
+        if (!testBit(open, index + maps.pad)) {
+            return false;
+        }
+        clearBit(open, index + maps.pad);
+        return true;
+    };
+
+    auto expandSlice = [&](unsigned worker) {
+        vector<uint64_t> &mine = claimed[worker];
+        mine.clear();
+        auto [begin, end] = sliceOf(frontier, worker);
+        for (size_t i = begin; i < end; ++i) {
+            Coord current_state{frontier[i]};
+            uint32_t color = map.colorOf(current_state);
+            uint64_t cell = current_state.index - color * layer;
+            worker_stats[worker].expand(color);
+            if (testBit(maps.buttons, cell) && charToNum(map.grid[cell]) != color) {
+                uint64_t button_state = charToNum(map.grid[cell]) * layer + cell;
+                if (claim(button_state)) {
+                    mine.push_back(button_state);
+                    worker_stats[worker].press(charToNum(map.grid[cell]));
+                }
+                continue;
+            }
+            uint64_t candidates = workers > 1 ? openNeighbors<true>(map, maps, open, current_state, cell, color)
+                                              : openNeighbors(map, maps, open, current_state, cell, color);
+            while (candidates) {
+                int dir = __builtin_ctzll(candidates);
+                candidates &= candidates - 1;
+                uint64_t next = current_state.index + moveOffset(map, dir);
+                if (claim(next)) {
+                    mine.push_back(next);
+                    if (cell + moveOffset(map, dir) == target_cell) {
+                        found[worker] = min(found[worker], next);
+                    }
+                }
+            }
+        }
+    };
+
+    auto assignParents = [&](unsigned worker) {
+        vector<uint8_t> &mine = parents[worker];
+        mine.resize(claimed[worker].size());
+        for (size_t i = 0; i < claimed[worker].size(); ++i) {
+            uint64_t index = claimed[worker][i];
+            uint32_t color = map.colorOf(Coord{index});
+            uint64_t cell = index - color * layer;
+            bool is_own_door = isupper(map.grid[cell]) && charToNum(map.grid[cell]) == color;
+            bool in_bounds[4] = {cell >= map.width, testBit(maps.has_east, cell) != 0,
+                                 cell + map.width < layer, testBit(maps.has_west, cell) != 0};
+            bool assigned = false;
+            for (int dir = 0; dir < 4 && !assigned; ++dir) {
+                uint64_t from = cell + moveOffset(map, dir);
+                if (!in_bounds[dir] || !btrace.discovered(Coord{index + moveOffset(map, dir)})) {
+                    continue;
+                }
+                bool forced = testBit(maps.buttons, from) && charToNum(map.grid[from]) != color;
+                if (!forced && !(is_own_door && testBit(maps.traps, from))) {
+                    mine[i] = static_cast<uint8_t>(kNorth + static_cast<uint64_t>(dir));
+                    assigned = true;
+                }
+            }
+            for (uint32_t from = 0; from <= map.num_colors && !assigned; ++from) {
+                if (from != color && btrace.discovered(Coord{from * layer + cell})) {
+                    mine[i] = static_cast<uint8_t>(kPressedFrom + from);
+                    assigned = true;
+                }
+            }
+        }
+    };
+
+    auto mergeSlice = [&](unsigned worker) {
+        vector<uint64_t> const &mine = claimed[worker];
+        presses[worker].clear();
+        for (size_t i = 0; i < mine.size(); ++i) {
+            uint8_t parent = parents[worker][i];
+            if (parent >= kPressedFrom) {
+                presses[worker].emplace_back(mine[i], parent - kPressedFrom);
+            } else if (workers > 1) {
+                btrace.setAtomic(Coord{mine[i]}, parent);
+            } else {
+                btrace.set(Coord{mine[i]}, parent);
+            }
+        }
+        copy(mine.begin(), mine.end(), next_frontier.begin() + static_cast<ptrdiff_t>(offsets[worker]));
+    };
+
+    auto runPass = [&](function<void(unsigned)> const &pass) {
+        if (workers == 1) {
+            pass(0);
+        } else {
+            pool.run(pass);
+        }
+    };
+    function<void(unsigned)> const expand_pass = expandSlice, parents_pass = assignParents, merge_pass = mergeSlice;
+
+    auto mergeStats = [&] {
+        for (Stats const &mine : worker_stats) {
+            stats.merge(mine);
+        }
+    };
+
+    while (!frontier.empty()) {
+        expanded += frontier.size();
+        stats.container(frontier.size());
+        workers = frontier.size() < kParallelLevel ? 1 : pool.size();
+        for (unsigned worker = workers; worker < num_threads; ++worker) {
+            claimed[worker].clear();
+        }
+
+        runPass(expand_pass);
+        runPass(parents_pass);
+        for (unsigned worker = 0; worker < num_threads; ++worker) {
+            offsets[worker + 1] = offsets[worker] + claimed[worker].size();
+        }
+        next_frontier.resize(offsets[num_threads]);
+        runPass(merge_pass);
+        for (unsigned worker = 0; worker < workers; ++worker) {
+            for (auto const &press : presses[worker]) {
+                btrace.setButton(Coord{press.first}, press.second);
+            }
+        }
+
+        uint64_t target_state = *min_element(found.begin(), found.end());
+        if (target_state != kNotFound) {
+            solution_state = Coord{target_state};
+            mergeStats();
+            return true;
+        }
+        frontier.swap(next_frontier);
+    }
+    mergeStats();
+    return false;
+}
+
+
+// Breadth first search over runs: maximal stretches of one row that can be walked along
+// in a layer without pressing anything. A run is discovered whole, so open floor and
+// corridors never go through the container a cell at a time; the search only stops at
+// runs' ends and the rows next to them, where buttons, traps and the target are, and
+// skips over discovered stretches of those rows a word of bits at a time. Every cell of a
+// run gets an ordinary backtrace code on discovery (pointing back along the row to where
+// the run was entered), so reconstructPath() and the no-solution report work as usual.
+// Discovers exactly the states the queue search would, but the path isn't always the
+// shortest.
+template <class Stats>
+bool searchRuns(Backtrace &btrace, PuzzleMap const &map, CellMaps const &maps, FrontierQueue &sc,
+                vector<uint64_t> &open, vector<uint64_t> &free, Coord &solution_state, uint64_t &expanded,
+                StopCheck &stop, Stats &stats) {
+    uint64_t const layer = map.layerSize();
+    uint64_t const width = map.width;
+    uint64_t const target_cell = map.target.index;
+    uint64_t const pad = maps.pad;
+
+    // free: passable without a press. open: passable and undiscovered. Both laid out like passable.
+    free.assign(maps.passable.begin(), maps.passable.end());
+    for (uint64_t cell = 0; cell < layer; ++cell) {
+        if (testBit(maps.buttons, cell)) {
+            for (uint32_t color = 0; color <= map.num_colors; ++color) {
+                if (color != charToNum(map.grid[cell])) {
+                    clearBit(free, color * layer + cell + pad);
+                }
+            }
+        }
+    }
+    open.assign(maps.passable.begin(), maps.passable.end());
+    sc.reset(map.numStates());
+
+    // Last state of the run starting at first
+    auto runEnd = [&](uint64_t first) {
+        return findBit(free, first + pad, first - first % width + width + pad, 1) - pad - 1;
+    };
+    // Discovers the run through an undiscovered free state entered with `code`; true if
+    // the target is on it
+    auto discoverRun = [&](uint64_t entry, uint64_t code, uint32_t from_color) {
+        uint64_t row = entry - entry % width;
+        uint64_t first = entry;
+        while (first > row && testBit(free, first - 1 + pad)) {
+            --first;
+        }
+        uint64_t last = runEnd(entry);
+        btrace.fill(first, entry, kEast);
+        btrace.fill(entry + 1, last + 1, kWest);
+        if (code == kButton) {
+            btrace.setButton(Coord{entry}, from_color);
+        } else {
+            btrace.set(Coord{entry}, code);
+        }
+        clearBits(open, first + pad, last + 1 + pad);
+        sc.push(Coord{first});
+        stats.container(sc.size());
+        uint64_t target_state = first - first % layer + target_cell;
+        if (first <= target_state && target_state <= last) {
+            solution_state = Coord{target_state};
+            return true;
+        }
+        return false;
+    };
+    // Steps from a state onto an undiscovered neighbor: walks onto its run if it's free,
+    // presses it if it's another color's button. True if that finds the target.
+    auto reach = [&](uint64_t next, uint64_t code, uint32_t color) {
+        if (testBit(free, next + pad)) {
+            return discoverRun(next, code, color);
+        }
+        clearBit(open, next + pad);
+        btrace.set(Coord{next}, code);
+        uint64_t cell = next - color * layer;
+        uint32_t new_color = charToNum(map.grid[cell]);
+        uint64_t button_state = new_color * layer + cell;
+        if (!testBit(open, button_state + pad)) {
+            return false;
+        }
+        stats.press(new_color);
+        return discoverRun(button_state, kButton, color);
+    };
+    // Reaches every undiscovered state in [first, last] from the row next to it
+    auto reachRow = [&](uint64_t first, uint64_t last, uint64_t code, uint32_t color) {
+        for (uint64_t next = findBit(open, first + pad, last + 1 + pad, 0); next <= last + pad;
+             next = findBit(open, next + 1, last + 1 + pad, 0)) {
+            if (reach(next - pad, code, color)) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    // The start isn't passable in its own layer, so it's a run of its own
+    btrace.set(map.start, kStart);
+    sc.push(map.start);
+    while (!sc.empty()) {
+        uint64_t first = sc.pop().index;
+        if (stop(++expanded)) {
+            return false;
+        }
+        uint32_t color = static_cast<uint32_t>(first / layer);
+        stats.expand(color);
+        uint64_t last = first == map.start.index ? first : runEnd(first);
+
+        uint64_t first_cell = first - color * layer, last_cell = last - color * layer;
+        if ((testBit(maps.has_west, first_cell) && testBit(open, first - 1 + pad) && reach(first - 1, kEast, color)) ||
+            (testBit(maps.has_east, last_cell) && testBit(open, last + 1 + pad) && reach(last + 1, kWest, color)) ||
+            (first_cell >= width && reachRow(first - width, last - width, kSouth, color)) ||
+            (last_cell + width < layer && reachRow(first + width, last + width, kNorth, color))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// SolveOptions::mem_limit: breadth first search for state spaces whose backtrace doesn't
+// fit in memory. The codes (a nibble per state) live in a temporary file cut into stripes
+// of whole rows, and only kCachedStripes of them are held at once. Each BFS level goes
+// through the stripes with candidates waiting for them: a candidate is a state plus the
+// code a neighbor proposed for it, checked against the backtrace only once its stripe is
+// loaded, so working on one stripe never needs another. Levels alternate direction, so the
+// stripes a level ends on are still cached when the next one starts. Candidate lists
+// past their share of the budget are appended to a spill file and read back
+// sequentially. No CellMaps are built; passability comes straight from the grid chars,
+// which for a puzzle file are already a read-only mapping the kernel can page out.
+class StripedSearch {
+public:
+    StripedSearch(PuzzleMap const &map, uint64_t mem_limit, string const &spill_dir) : map(map) {
+        uint64_t const cache_bytes = mem_limit / 2;
+        uint64_t const rows = (map.num_colors + uint64_t{1}) * map.height;
+        uint64_t stripe_rows = max<uint64_t>(1, cache_bytes / kCachedStripes / max<uint64_t>(1, map.width / 2));
+        stripe_rows = min(stripe_rows, rows);
+        stripe_states = stripe_rows * map.width;
+        stripe_words = (stripe_states + kPerWord - 1) / kPerWord;
+        num_stripes = (rows + stripe_rows - 1) / stripe_rows;
+        // The waiting lists of two levels together stay under the other half
+        candidate_budget = max<uint64_t>(1024, mem_limit / 4 / sizeof(uint64_t));
+        on_disk.assign(num_stripes, false);
+        slots.resize(min<uint64_t>(kCachedStripes, num_stripes));
+        for (int level = 0; level < 2; ++level) {
+            waiting[level].resize(num_stripes);
+            spilled[level].resize(num_stripes);
+        }
+
+        string dir = spill_dir;
+        if (dir.empty()) {
+            char const *tmp = getenv("TMPDIR");
+            dir = tmp && *tmp ? tmp : "/tmp";
+        }
+        for (int &fd : fds) {
+            string path = dir + "/puzzle-spill-XXXXXX";
+            fd = mkstemp(&path[0]);
+            if (fd < 0) {
+                io_ok = false;
+                return;
+            }
+            unlink(path.c_str());
+        }
+    }
+
+    ~StripedSearch() {
+        for (int fd : fds) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    StripedSearch(StripedSearch const &) = delete;
+    StripedSearch &operator=(StripedSearch const &) = delete;
+
+    bool ok() const { return io_ok; }
+    uint64_t cacheBytes() const { return slots.size() * stripe_words * sizeof(uint64_t); }
+
+    // Returns true and sets solution_state if the target was reached
+    template <class Stats>
+    bool search(Coord &solution_state, uint64_t &expanded, Stats &stats) {
+        uint64_t const layer = map.layerSize();
+        uint64_t const width = map.width;
+        propose(0, map.start.index, 0, kStart);
+        vector<uint64_t> chunk;
+        for (uint64_t level = 0; io_ok; ++level) {
+            int const cur = level & 1, next = cur ^ 1;
+            buffered = 0;
+            bool any = false;
+            bool found = false;
+            for (uint64_t k = 0; k < num_stripes && !found && io_ok; ++k) {
+                uint64_t const stripe = level & 1 ? num_stripes - 1 - k : k;
+                if (waiting[cur][stripe].empty() && spilled[cur][stripe].empty()) {
+                    continue;
+                }
+                any = true;
+                Slot &slot = load(stripe);
+                uint64_t const first = stripe * stripe_states;
+
+                // Confirms one candidate and proposes its neighbors for the next level
+                auto confirm = [&](uint64_t entry) {
+                    uint64_t const index = entry >> 8;
+                    uint64_t const code = entry & 7;
+                    if (codeAt(slot, index - first) != kUndiscovered) {
+                        return false;
+                    }
+                    setCode(slot, index - first, code);
+                    uint32_t const color = static_cast<uint32_t>(index / layer);
+                    uint64_t const cell = index - color * layer;
+                    if (code == kButton) {
+                        pressed_from[index] = static_cast<uint8_t>((entry >> 3) & 31);
+                        stats.press(color);
+                    }
+                    ++expanded;
+                    stats.expand(color);
+                    if (cell == map.target.index) {
+                        solution_state = Coord{index};
+                        return true;
+                    }
+
+                    // Standing on another color's button presses it, nothing else
+                    char const here = map.grid[cell];
+                    if ((islower(here) || here == '^') && charToNum(here) != color) {
+                        propose(next, charToNum(here) * layer + cell, color, kButton);
+                        return false;
+                    }
+                    uint64_t const column = cell % width;
+                    bool const in_bounds[4] = {cell >= width, column + 1 < width, cell + width < layer, column > 0};
+                    for (int dir = 0; dir < 4; ++dir) {
+                        if (!in_bounds[dir]) {
+                            continue;
+                        }
+                        int64_t const offset = moveOffset(map, dir);
+                        if (!passableIn(map.grid[cell + offset], color)) {
+                            continue;
+                        }
+                        uint64_t const neighbor = index + offset;
+                        // Already discovered in this stripe: no need to wait a level to find out
+                        if (neighbor - first < stripe_states && codeAt(slot, neighbor - first) != kUndiscovered) {
+                            continue;
+                        }
+                        propose(next, neighbor, 0, kBackCodes[dir]);
+                    }
+                    return false;
+                };
+
+                for (auto const &extent : spilled[cur][stripe]) {
+                    for (uint64_t done = 0; done < extent.second && !found && io_ok;) {
+                        uint64_t count = min<uint64_t>(extent.second - done, kChunkEntries);
+                        chunk.resize(count);
+                        readAll(fds[1 + cur], chunk.data(), count * sizeof(uint64_t),
+                                extent.first + done * sizeof(uint64_t));
+                        for (uint64_t i = 0; i < count && !found && io_ok; ++i) {
+                            found = confirm(chunk[i]);
+                        }
+                        done += count;
+                    }
+                }
+                for (uint64_t i = 0; i < waiting[cur][stripe].size() && !found; ++i) {
+                    found = confirm(waiting[cur][stripe][i]);
+                }
+                vector<uint64_t>().swap(waiting[cur][stripe]);
+                spilled[cur][stripe].clear();
+            }
+            if (found || !any) {
+                return found && io_ok;
+            }
+            spill_end[cur] = 0;
+            stats.container(buffered + spilled_count);
+            spilled_count = 0;
+        }
+        return false;
+    }
+
+    // Path by walking the codes backward from the solution; target first and start last
+    void reconstruct(Coord solution_state, vector<Coord> &path) {
+        path.clear();
+        uint64_t index = solution_state.index;
+        while (io_ok) {
+            path.push_back(Coord{index});
+            uint64_t const stripe = index / stripe_states;
+            uint64_t const code = codeAt(load(stripe), index - stripe * stripe_states);
+            if (code == kNorth) {
+                index -= map.width;
+            } else if (code == kEast) {
+                index += 1;
+            } else if (code == kSouth) {
+                index += map.width;
+            } else if (code == kWest) {
+                index -= 1;
+            } else if (code == kButton) {
+                index = pressed_from[index] * map.layerSize() + map.cellOf(Coord{index});
+            } else {
+                break;
+            }
+        }
+    }
+
+    // Calls f(index) for every discovered state, streaming the stripes in order
+    template <class F>
+    void forEachDiscovered(F f) {
+        for (uint64_t stripe = 0; stripe < num_stripes && io_ok; ++stripe) {
+            Slot &slot = load(stripe);
+            for (uint64_t w = 0; w < stripe_words; ++w) {
+                // Low bit of every nonzero nibble
+                uint64_t word = slot.words[w];
+                uint64_t nonzero = (word | word >> 1 | word >> 2 | word >> 3) & 0x1111111111111111ull;
+                for (; nonzero; nonzero &= nonzero - 1) {
+                    f(stripe * stripe_states + w * kPerWord + static_cast<uint64_t>(__builtin_ctzll(nonzero)) / 4);
+                }
+            }
+        }
+    }
+
+private:
+    static constexpr uint64_t kPerWord = 16;             // nibbles per word
+    static constexpr uint64_t kCachedStripes = 8;
+    static constexpr uint64_t kChunkEntries = 1 << 16;   // candidates read back from a spill at once
+    static constexpr uint64_t kNoStripe = ~uint64_t{0};
+
+    struct Slot {
+        uint64_t stripe = kNoStripe;
+        vector<uint64_t> words;
+        bool dirty = false;
+        uint64_t last_used = 0;
+    };
+
+    static uint64_t codeAt(Slot const &slot, uint64_t offset) {
+        return (slot.words[offset / kPerWord] >> (offset % kPerWord * 4)) & 15;
+    }
+    static void setCode(Slot &slot, uint64_t offset, uint64_t code) {
+        slot.words[offset / kPerWord] |= code << (offset % kPerWord * 4);
+        slot.dirty = true;
+    }
+
+    // Candidate entries are index << 8 | pressed-from color << 3 | code
+    void propose(int level, uint64_t index, uint64_t origin, uint64_t code) {
+        waiting[level][index / stripe_states].push_back(index << 8 | origin << 3 | code);
+        if (++buffered > candidate_budget) {
+            spill(level);
+        }
+    }
+
+    // Appends every waiting list of the level to its spill file, one extent per stripe
+    void spill(int level) {
+        for (uint64_t stripe = 0; stripe < num_stripes; ++stripe) {
+            vector<uint64_t> &list = waiting[level][stripe];
+            if (list.empty()) {
+                continue;
+            }
+            writeAll(fds[1 + level], list.data(), list.size() * sizeof(uint64_t), spill_end[level]);
+            spilled[level][stripe].emplace_back(spill_end[level], list.size());
+            spill_end[level] += list.size() * sizeof(uint64_t);
+            spilled_count += list.size();
+            vector<uint64_t>().swap(list);
+        }
+        buffered = 0;
+    }
+
+    // The stripe's codes in a cache slot, writing back the least recently used one if dirty
+    Slot &load(uint64_t stripe) {
+        Slot *victim = &slots[0];
+        for (Slot &slot : slots) {
+            if (slot.stripe == stripe) {
+                slot.last_used = ++clock;
+                return slot;
+            }
+            if (slot.last_used < victim->last_used) {
+                victim = &slot;
+            }
+        }
+        if (victim->stripe != kNoStripe && victim->dirty) {
+            writeAll(fds[0], victim->words.data(), stripe_words * sizeof(uint64_t),
+                     victim->stripe * stripe_words * sizeof(uint64_t));
+            on_disk[victim->stripe] = true;
+        }
+        victim->words.resize(stripe_words);
+        if (on_disk[stripe]) {
+            readAll(fds[0], victim->words.data(), stripe_words * sizeof(uint64_t),
+                    stripe * stripe_words * sizeof(uint64_t));
+        } else {
+            fill(victim->words.begin(), victim->words.end(), 0);
+        }
+        victim->stripe = stripe;
+        victim->dirty = false;
+        victim->last_used = ++clock;
+        return *victim;
+    }
+
+    void readAll(int fd, void *data, uint64_t size, uint64_t offset) {
+        char *bytes = static_cast<char *>(data);
+        while (size > 0 && io_ok) {
+            ssize_t got = pread(fd, bytes, size, static_cast<off_t>(offset));
+            if (got <= 0) {
+                if (got < 0 && errno == EINTR) {
+                    continue;
+                }
+                io_ok = false;
+                return;
+            }
+            bytes += got;
+            size -= static_cast<uint64_t>(got);
+            offset += static_cast<uint64_t>(got);
+        }
+    }
+
+    void writeAll(int fd, void const *data, uint64_t size, uint64_t offset) {
+        char const *bytes = static_cast<char const *>(data);
+        while (size > 0 && io_ok) {
+            ssize_t put = pwrite(fd, bytes, size, static_cast<off_t>(offset));
+            if (put <= 0) {
+                if (put < 0 && errno == EINTR) {
+                    continue;
+                }
+                io_ok = false;
+                return;
+            }
+            bytes += put;
+            size -= static_cast<uint64_t>(put);
+            offset += static_cast<uint64_t>(put);
+        }
+    }
+
+    PuzzleMap const &map;
+    uint64_t stripe_states = 0;
+    uint64_t stripe_words = 0;
+    uint64_t num_stripes = 0;
+    uint64_t candidate_budget = 0;
+    vector<Slot> slots;
+    vector<bool> on_disk; // stripe has been written back at least once
+    uint64_t clock = 0;
+    int fds[3] = {-1, -1, -1}; // backtrace codes, then the spill files of even and odd levels
+    bool io_ok = true;
+
+    // Candidates for the level being worked on and the next one, by stripe
+    vector<vector<uint64_t>> waiting[2];
+    vector<vector<pair<uint64_t, uint64_t>>> spilled[2]; // (byte offset, count) extents
+    uint64_t spill_end[2] = {0, 0};
+    uint64_t buffered = 0;      // entries in the next level's waiting lists
+    uint64_t spilled_count = 0; // entries the next level has in its spill file
+    unordered_map<uint64_t, uint8_t> pressed_from;
+};
+
+// Counts the presses along a solved path (in either form) for the stats
+void countPathPresses(PuzzleMap const &map, SolveResult &result) {
+    for (size_t i = 1; i < result.path.size(); ++i) {
+        uint32_t color = map.colorOf(result.path[i]);
+        if (color != map.colorOf(result.path[i - 1])) {
+            ++(color == 0 ? result.stats.path_trap_presses : result.stats.path_presses);
+        }
+    }
+    for (MoveRun const &run : result.moves) {
+        if (!isupper(static_cast<unsigned char>(run.move))) {
+            ++(charToNum(run.move) == 0 ? result.stats.path_trap_presses : result.stats.path_presses);
+        }
+    }
+}
+
+// SolveOptions::mem_limit: the whole solve with no CellMaps or in-memory backtrace
+SolveStatus solveStriped(PuzzleMap const &map, SolveOptions const &options, SolveResult &result) {
+    result.visited = VisitedStore::kStriped;
+    StripedSearch striped(map, options.mem_limit, options.spill_dir);
+    Coord solution_state = map.start;
+    auto search_start = chrono::steady_clock::now();
+    NoStats no_stats;
+    bool solution_found = striped.ok() && (options.stats ? striped.search(solution_state, result.expanded, result.stats)
+                                                         : striped.search(solution_state, result.expanded, no_stats));
+    result.search_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - search_start).count();
+    result.visited_bytes = striped.cacheBytes();
+
+    if (solution_found) {
+        auto reconstruct_start = chrono::steady_clock::now();
+        striped.reconstruct(solution_state, result.path);
+        reverse(result.path.begin(), result.path.end());
+        if (options.path_format == PathFormat::kMoves) {
+            // The stripes are only read backward, so the states are gathered first here
+            encodeMoves(map, result.path, result.moves);
+            result.path.clear();
+        }
+        result.reconstruct_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - reconstruct_start).count();
+        if (options.stats) {
+            countPathPresses(map, result);
+        }
+    }
+    uint64_t layer = map.layerSize();
+    if (!solution_found) {
+        result.discovered.assign((layer + 63) / 64, 0);
+    }
+    if (options.stats || !solution_found) {
+        striped.forEachDiscovered([&](uint64_t index) {
+            if (options.stats) {
+                ++result.stats.discovered[index / layer];
+            }
+            if (!solution_found) {
+                setBit(result.discovered, index % layer);
+            }
+        });
+    }
+    if (!striped.ok()) {
+        result.path.clear();
+        result.discovered.clear();
+        return result.status = SolveStatus::kSpillFailed;
+    }
+    return result.status = solution_found ? SolveStatus::kSolved : SolveStatus::kNoSolution;
+}
+
+// VisitedStore::kAuto. Small state spaces and the parallel search get the dense store.
+// Past that the lazy one is picked when at least half the layers can't ever be entered
+// (no button of their color on the map) or the dense array would pass ~100 MB, and the
+// sparse one once it would pass ~6 GB, where even the pages of one busy layer add up.
+VisitedStore chooseVisitedStore(PuzzleMap const &map, CellMaps const &maps, SolveOptions const &options) {
+    uint64_t const states = map.numStates();
+    if (options.threads != 0 || states <= (uint64_t{1} << 20)) {
+        return VisitedStore::kDense;
+    }
+    if (states >= (uint64_t{1} << 34)) {
+        return VisitedStore::kSparse;
+    }
+    uint32_t button_colors = 0; // bit per color that has a button (or a '^' for color 0)
+    for (uint64_t word = 0; word < maps.buttons.size(); ++word) {
+        for (uint64_t bits = maps.buttons[word]; bits; bits &= bits - 1) {
+            button_colors |= uint32_t{1} << charToNum(map.grid[word * 64 + __builtin_ctzll(bits)]);
+        }
+    }
+    uint32_t enterable = __builtin_popcount(button_colors | 1);
+    if (enterable * 2 <= map.num_colors + 1 || states >= (uint64_t{1} << 28)) {
+        return VisitedStore::kLazy;
+    }
+    return VisitedStore::kDense;
+}
+
+// Whether a cell has a neighbor in direction dir (N, E, S, W), i.e. isn't on that edge
+inline bool hasNeighbor(PuzzleMap const &map, CellMaps const &maps, uint64_t cell, int dir) {
+    switch (dir) {
+        case 0: return cell >= map.width;
+        case 1: return testBit(maps.has_east, cell);
+        case 2: return cell + map.width < map.layerSize();
+        default: return testBit(maps.has_west, cell);
+    }
+}
+
+// Dead-end pockets: '.' and door cells with at most one open neighbor, peeled off until
+// none are left. Standing on one never changes the state, so a path into a pocket can
+// only come back out the way it went in, and no search needs it. Open means passable in a
+// color some button switches to; a door whose color has no button never opens. The
+// pruned cells are closed in every layer of maps.passable and set in pruned (one bit per
+// cell). Returns how many there are.
+uint64_t pruneDeadEnds(PuzzleMap const &map, CellMaps &maps, vector<uint64_t> &pruned) {
+    uint64_t const layer = map.layerSize();
+    uint64_t const cell_words = (layer + 63) / 64;
+    uint64_t const width = map.width;
+    uint32_t enterable = 1; // colors a press can switch to; '^' always
+    for (uint64_t word = 0; word < maps.buttons.size(); ++word) {
+        for (uint64_t bits = maps.buttons[word]; bits; bits &= bits - 1) {
+            enterable |= uint32_t{1} << charToNum(map.grid[word * 64 + __builtin_ctzll(bits)]);
+        }
+    }
+    // live: open (or the start) and not pruned yet; peelable: open '.' and doors
+    uint8_t kinds[256] = {}; // bit 0 live, bit 1 peelable
+    for (int c = 0; c < 256; ++c) {
+        bool door = isupper(c) && ((enterable >> charToNum(static_cast<char>(c))) & 1);
+        kinds[c] = static_cast<uint8_t>((door || passableIn(static_cast<char>(c), 0) || c == '@') | (door || c == '.') << 1);
+    }
+    vector<uint64_t> live(cell_words, 0), peelable(cell_words, 0);
+    for (uint64_t row = 0, cell = 0; row < map.height; ++row) {
+        char const *chars = map.grid.row(row);
+        for (uint64_t column = 0; column < width; ++column, ++cell) {
+            uint64_t kind = kinds[static_cast<unsigned char>(chars[column])];
+            live[cell >> 6] |= (kind & 1) << (cell & 63);
+            peelable[cell >> 6] |= (kind >> 1) << (cell & 63);
+        }
+    }
+
+    // Peelable cells without two live neighbors, 64 at a time
+    pruned.assign(cell_words, 0);
+    vector<uint64_t> work;
+    for (uint64_t w = 0; w < cell_words; ++w) {
+        if (peelable[w] == 0) continue;
+        int64_t at = static_cast<int64_t>(w * 64);
+        uint64_t n = bitsFrom(live, at - static_cast<int64_t>(width));
+        uint64_t e = bitsFrom(live, at + 1) & maps.has_east[w];
+        uint64_t s = bitsFrom(live, at + static_cast<int64_t>(width));
+        uint64_t west = bitsFrom(live, at - 1) & maps.has_west[w];
+        uint64_t two_or_more = (n & (e | s | west)) | (e & (s | west)) | (s & west);
+        for (uint64_t bits = peelable[w] & ~two_or_more; bits; bits &= bits - 1) {
+            work.push_back(w * 64 + __builtin_ctzll(bits));
+        }
+    }
+    uint64_t count = 0;
+    while (!work.empty()) {
+        uint64_t cell = work.back();
+        work.pop_back();
+        if (!testBit(live, cell)) {
+            continue;
+        }
+        uint64_t const around[4] = {cell - width, cell + 1, cell + width, cell - 1};
+        bool const inside[4] = {cell >= width, testBit(maps.has_east, cell) != 0, cell + width < layer,
+                                testBit(maps.has_west, cell) != 0};
+        uint32_t neighbors = 0;
+        uint64_t last = layer;
+        for (int dir = 0; dir < 4; ++dir) {
+            if (inside[dir] && testBit(live, around[dir])) {
+                ++neighbors;
+                last = around[dir];
+            }
+        }
+        if (neighbors > 1) {
+            continue;
+        }
+        clearBit(live, cell);
+        setBit(pruned, cell);
+        ++count;
+        if (last != layer && testBit(peelable, last)) {
+            work.push_back(last);
+        }
+    }
+    if (count != 0) {
+        for (uint32_t color = 0; color <= map.num_colors; ++color) {
+            clearBitsAt(maps.passable, color * layer + maps.pad, pruned.data(), layer);
+        }
+    }
+    return count;
+}
+
+// A step into a pocket for markPocketCells: the cell, the one it was entered from and the
+// colors the walk can still be in
+struct PocketStep {
+    uint64_t cell;
+    uint64_t parent;
+    uint32_t colors;
+};
+
+// The no-solution report after pruneDeadEnds: sets the pruned cells the unpruned search
+// would have walked into, given discovered already holds the cells it did reach. Each
+// pocket is a tree hanging off a single live cell, so one walk from there carries the set
+// of colors that cell was reached in, narrowed at each door.
+void markPocketCells(PuzzleMap const &map, CellMaps const &maps, vector<uint64_t> const &pruned, Backtrace const &bt,
+                     vector<PocketStep> &stack, vector<uint64_t> &discovered) {
+    uint64_t const layer = map.layerSize();
+    uint64_t const width = map.width;
+    // Pocket cells are '.' or doors; the colors each is open in
+    auto openIn = [&](uint64_t cell) {
+        char c = map.grid[cell];
+        return isupper(c) ? uint32_t{1} << charToNum(c) : ~uint32_t{0};
+    };
+    for (uint64_t w = 0; w < pruned.size(); ++w) {
+        int64_t at = static_cast<int64_t>(w * 64);
+        uint64_t touching = bitsFrom(pruned, at - static_cast<int64_t>(width)) |
+                            bitsFrom(pruned, at + static_cast<int64_t>(width)) |
+                            (bitsFrom(pruned, at + 1) & maps.has_east[w]) |
+                            (bitsFrom(pruned, at - 1) & maps.has_west[w]);
+        uint64_t reached = w < discovered.size() ? discovered[w] : 0;
+        for (uint64_t bits = touching & reached & ~pruned[w]; bits; bits &= bits - 1) {
+            uint64_t const cell = w * 64 + __builtin_ctzll(bits);
+            uint32_t colors = 0;
+            for (uint32_t color = 0; color <= map.num_colors; ++color) {
+                colors |= uint32_t{bt.code(Coord{color * layer + cell}) != kUndiscovered} << color;
+            }
+            // A button (or ^) in any other color is pressed, not walked off
+            if (testBit(maps.buttons, cell)) {
+                colors &= uint32_t{1} << charToNum(map.grid[cell]);
+            }
+            // Doors of the current color are closed while standing on a ^
+            bool const on_trap = testBit(maps.traps, cell);
+            for (int dir = 0; dir < 4; ++dir) {
+                uint64_t next = cell + moveOffset(map, dir);
+                if (hasNeighbor(map, maps, cell, dir) && testBit(pruned, next) &&
+                    !(on_trap && isupper(map.grid[next]))) {
+                    stack.push_back(PocketStep{next, cell, colors});
+                }
+            }
+            while (!stack.empty()) {
+                PocketStep step = stack.back();
+                stack.pop_back();
+                uint32_t open = step.colors & openIn(step.cell);
+                if (open == 0) continue;
+                setBit(discovered, step.cell);
+                for (int dir = 0; dir < 4; ++dir) {
+                    uint64_t next = step.cell + moveOffset(map, dir);
+                    if (next != step.parent && hasNeighbor(map, maps, step.cell, dir) && testBit(pruned, next)) {
+                        stack.push_back(PocketStep{next, step.cell, open});
+                    }
+                }
+            }
+        }
+    }
+}
+
+// SolveOptions::checkpoint file: this header, the waiting states in the order the
+// frontier's forEach gives them, then the backtrace as Backtrace::save writes it. Native
+// byte order; it's only meant to be read back on the same machine.
+struct CheckpointHeader {
+    char magic[8];     // "PZLCKP01"
+    uint64_t map_hash; // mapHash() of the puzzle being solved
+    uint32_t search_mode;
+    uint32_t visited;  // the VisitedStore the backtrace is kept in
+    uint32_t pruned;   // SolveOptions::prune, since it changes which states are open
+    uint32_t reserved;
+    uint64_t expanded;
+    uint64_t waiting;  // states in the frontier
+    double search_ms;  // time spent searching before this checkpoint
+    SearchStats stats;
+};
+char const kCheckpointMagic[8] = {'P', 'Z', 'L', 'C', 'K', 'P', '0', '1'};
+
+// Hash of a puzzle's size, start, target and every cell, however it was loaded
+uint64_t mapHash(PuzzleMap const &map) {
+    uint64_t const fields[5] = {map.num_colors, map.height, map.width, map.start.index, map.target.index};
+    uint64_t hash = checksumBytes(0, reinterpret_cast<char const *>(fields), sizeof fields);
+    for (uint32_t row = 0; row < map.height; ++row) {
+        hash = checksumBytes(hash, map.grid.row(row), map.width);
+    }
+    return hash;
+}
+
+// Reads a checkpoint's header and checks it belongs to this puzzle and these options
+bool readCheckpointHeader(istream &in, PuzzleMap const &map, SolveOptions const &options, CheckpointHeader &header) {
+    return in.read(reinterpret_cast<char *>(&header), sizeof header) &&
+           memcmp(header.magic, kCheckpointMagic, sizeof header.magic) == 0 && header.map_hash == mapHash(map) &&
+           header.search_mode == static_cast<uint32_t>(options.search_mode) &&
+           header.pruned == static_cast<uint32_t>(options.prune) &&
+           header.visited >= static_cast<uint32_t>(VisitedStore::kDense) &&
+           header.visited <= static_cast<uint32_t>(VisitedStore::kSparse);
+}
+
+// The rest of a checkpoint, into the frontier, btrace (reset to header.visited) and open
+// (still all of passable, so every discovered state's bit is cleared again)
+template <class Frontier>
+bool readCheckpoint(istream &in, PuzzleMap const &map, CellMaps const &maps, CheckpointHeader const &header,
+                    Frontier &frontier, Backtrace &btrace, vector<uint64_t> &open) {
+    frontier.reset(map.numStates());
+    for (uint64_t i = 0, index = 0; i < header.waiting; ++i) {
+        if (!in.read(reinterpret_cast<char *>(&index), sizeof index) || index >= map.numStates()) {
+            return false;
+        }
+        frontier.push(Coord{index});
+    }
+    if (!btrace.load(in, map.numStates())) {
+        return false;
+    }
+    btrace.forEachDiscovered([&](uint64_t index) { clearBit(open, index + maps.pad); });
+    return true;
+}
+
+// Saves a search time_limit stopped. It's written next to path and renamed over it, so
+// a save that fails halfway never replaces a good checkpoint with a broken one.
+template <class Frontier>
+bool writeCheckpoint(string const &path, CheckpointHeader const &header, Frontier const &frontier,
+                     Backtrace const &btrace) {
+    string const temporary = path + ".tmp";
+    ofstream out(temporary, ios::binary | ios::trunc);
+    out.write(reinterpret_cast<char const *>(&header), sizeof header);
+    frontier.forEach([&out](uint64_t index) { out.write(reinterpret_cast<char const *>(&index), sizeof index); });
+    btrace.save(out);
+    out.close();
+    if (!out || rename(temporary.c_str(), path.c_str()) != 0) {
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Scratch space kept between solves so consecutive puzzles reuse the allocations
+struct Solver::Buffers {
+    CellMaps maps;
+    Backtrace btrace;
+    FrontierQueue queue;
+    FrontierStack stack;
+    vector<uint64_t> open;
+    vector<uint64_t> free; // --runs only
+    vector<uint64_t> pruned;
+    vector<PocketStep> pocket_stack;
+};
+
+Solver::Solver() : buffers(make_unique<Buffers>()) {}
+Solver::~Solver() = default;
+Solver::Solver(Solver &&) noexcept = default;
+Solver &Solver::operator=(Solver &&) noexcept = default;
+
+SolveStatus Solver::solve(PuzzleMap const &map, SolveOptions const &options, SolveResult &result) {
+    result.search_mode = options.search_mode;
+    result.path.clear();
+    result.moves.clear();
+    result.pruned_cells = 0;
+    result.discovered.clear();
+    result.expanded = 0;
+    result.search_ms = 0;
+    result.reconstruct_ms = 0;
+    result.stats = SearchStats{};
+    bool threads_ok = options.threads == 0 ||
+                      (options.search_mode == SearchMode::kQueue &&
+                       (options.visited == VisitedStore::kAuto || options.visited == VisitedStore::kDense));
+    bool mem_limit_ok = options.mem_limit == 0 ||
+                        (options.search_mode == SearchMode::kQueue && options.threads == 0 &&
+                         options.visited == VisitedStore::kAuto);
+    bool const checkpointing = !options.checkpoint.empty();
+    bool stop_ok = (!options.cancel && options.time_limit == 0 && !checkpointing) ||
+                   (options.threads == 0 && options.mem_limit == 0);
+    bool checkpoint_ok = !checkpointing || options.search_mode == SearchMode::kQueue ||
+                         options.search_mode == SearchMode::kStack;
+    if (options.search_mode == SearchMode::kNone || !threads_ok || !mem_limit_ok || !stop_ok || !checkpoint_ok ||
+        !(options.time_limit >= 0)) {
+        return result.status = SolveStatus::kInvalidOptions;
+    }
+    if (options.mem_limit != 0) {
+        return solveStriped(map, options, result);
+    }
+
+    CellMaps &maps = buffers->maps;
+    Backtrace &btrace = buffers->btrace;
+    buildCellMaps(map, maps);
+    result.pruned_cells = options.prune ? pruneDeadEnds(map, maps, buffers->pruned) : 0;
+
+    // A checkpoint that exists is resumed, with the store it was saved from
+    CheckpointHeader saved{};
+    ifstream checkpoint_in;
+    if (checkpointing) {
+        checkpoint_in.open(options.checkpoint, ios::binary);
+    }
+    bool const resume = checkpoint_in.is_open();
+    if (resume && !readCheckpointHeader(checkpoint_in, map, options, saved)) {
+        return result.status = SolveStatus::kCheckpointFailed;
+    }
+    result.visited = resume ? static_cast<VisitedStore>(saved.visited)
+                   : options.visited == VisitedStore::kAuto ? chooseVisitedStore(map, maps, options) : options.visited;
+    btrace.reset(map, result.visited);
+
+    bool const takes_passable = options.threads == 0 &&
+        (options.search_mode == SearchMode::kQueue || options.search_mode == SearchMode::kStack ||
+         options.search_mode == SearchMode::kAStar);
+    if (takes_passable) {
+        // Hands passable over as the open bitmap; the cell maps are rebuilt every solve
+        buffers->open.swap(maps.passable);
+    }
+    if (resume) {
+        bool loaded = options.search_mode == SearchMode::kStack
+            ? readCheckpoint(checkpoint_in, map, maps, saved, buffers->stack, btrace, buffers->open)
+            : readCheckpoint(checkpoint_in, map, maps, saved, buffers->queue, btrace, buffers->open);
+        if (!loaded) {
+            return result.status = SolveStatus::kCheckpointFailed;
+        }
+        checkpoint_in.close();
+        result.expanded = saved.expanded;
+        result.stats = saved.stats;
+    }
+
+    // The limit counts from here, so a resumed search always gets its full time
+    auto search_start = chrono::steady_clock::now();
+    StopCheck stop;
+    stop.cancel = options.cancel;
+    if (options.time_limit > 0) {
+        stop.deadline = search_start + chrono::duration_cast<chrono::steady_clock::duration>(
+                                          chrono::duration<double>(options.time_limit));
+    }
+    if (options.progress) {
+        stop.progress = &options.progress;
+        stop.bound = map.numStates();
+        stop.next_report = search_start + chrono::seconds(1);
+    }
+
+    Coord solution_state = map.start;
+    uint64_t &expanded = result.expanded;
+
+    // Each search is built once with real counters and once with NoStats
+    auto search = [&](auto &counters) {
+        if (options.search_mode == SearchMode::kAStar) {
+            return searchAStar(btrace, map, maps, buffers->open, solution_state, expanded, stop, counters);
+        } else if (options.search_mode == SearchMode::kBidirectional) {
+            return searchBidirectional(btrace, map, maps, solution_state, expanded, stop, counters);
+        } else if (options.search_mode == SearchMode::kRuns) {
+            return searchRuns(btrace, map, maps, buffers->queue, buffers->open, buffers->free, solution_state,
+                              expanded, stop, counters);
+        } else if (options.threads != 0) {
+            return searchParallel(btrace, map, maps, options.threads, solution_state, expanded, counters);
+        } else if (options.search_mode == SearchMode::kStack) {
+            return searchFrontier(btrace, map, maps, buffers->stack, buffers->open, solution_state, expanded,
+                                  resume, stop, counters);
+        }
+        return searchFrontier(btrace, map, maps, buffers->queue, buffers->open, solution_state, expanded,
+                              resume, stop, counters);
+    };
+    NoStats no_stats;
+    bool solution_found = options.stats ? search(result.stats) : search(no_stats);
+    result.search_ms = saved.search_ms +
+                       chrono::duration<double, milli>(chrono::steady_clock::now() - search_start).count();
+    if (!solution_found && options.cancel && options.cancel->load()) {
+        return result.status = SolveStatus::kCancelled;
+    }
+
+    result.visited_bytes = btrace.bytes();
+    if (!solution_found && stop.timed_out) {
+        if (checkpointing) {
+            CheckpointHeader header{};
+            memcpy(header.magic, kCheckpointMagic, sizeof header.magic);
+            header.map_hash = mapHash(map);
+            header.search_mode = static_cast<uint32_t>(options.search_mode);
+            header.visited = static_cast<uint32_t>(result.visited);
+            header.pruned = options.prune;
+            header.expanded = result.expanded;
+            header.search_ms = result.search_ms;
+            header.stats = result.stats;
+            bool written = false;
+            if (options.search_mode == SearchMode::kStack) {
+                header.waiting = buffers->stack.size();
+                written = writeCheckpoint(options.checkpoint, header, buffers->stack, btrace);
+            } else {
+                header.waiting = buffers->queue.size();
+                written = writeCheckpoint(options.checkpoint, header, buffers->queue, btrace);
+            }
+            if (!written) {
+                return result.status = SolveStatus::kCheckpointFailed;
+            }
+        }
+        return result.status = SolveStatus::kTimedOut;
+    }
+    if (resume) {
+        // Finished, so the checkpoint has served its purpose
+        remove(options.checkpoint.c_str());
+    }
+
+    uint64_t layer = map.layerSize();
+    if (options.stats) {
+        btrace.forEachDiscovered([&](uint64_t index) { ++result.stats.discovered[index / layer]; });
+    }
+
+    if (!solution_found) {
+        // Cells reached in any color, for the Discovered report
+        result.discovered.assign((layer + 63) / 64, 0);
+        btrace.forEachDiscovered([&](uint64_t index) { setBit(result.discovered, index % layer); });
+        if (result.pruned_cells != 0) {
+            markPocketCells(map, maps, buffers->pruned, btrace, buffers->pocket_stack, result.discovered);
+        }
+        return result.status = SolveStatus::kNoSolution;
+    }
+
+    auto reconstruct_start = chrono::steady_clock::now();
+    if (options.path_format == PathFormat::kMoves) {
+        reconstructMoves(map, btrace, solution_state, result.moves);
+    } else {
+        reconstructPath(map, btrace, solution_state, result.path);
+        reverse(result.path.begin(), result.path.end());
+    }
+    result.reconstruct_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - reconstruct_start).count();
+    if (options.stats) {
+        countPathPresses(map, result);
+    }
+    return result.status = SolveStatus::kSolved;
+}
+
+char const *searchModeName(SearchMode mode) {
+    switch (mode) {
+        case SearchMode::kQueue: return "queue";
+        case SearchMode::kStack: return "stack";
+        case SearchMode::kAStar: return "astar";
+        case SearchMode::kBidirectional: return "bidirectional";
+        case SearchMode::kRuns: return "runs";
+        default: return "none";
+    }
+}
+
+SolveStatus solvePortfolio(PuzzleMap const &map, vector<SearchMode> const &modes, SolveOptions const &options,
+                           SolveResult &result) {
+    if (modes.empty() || options.threads != 0 || options.mem_limit != 0 || options.cancel ||
+        !options.checkpoint.empty()) {
+        result.search_mode = SearchMode::kNone;
+        return result.status = SolveStatus::kInvalidOptions;
+    }
+    atomic<bool> stop{false};
+    mutex winner_lock;
+    size_t winner = modes.size();
+    vector<SolveResult> results(modes.size());
+    WorkerPool pool(static_cast<unsigned>(modes.size()));
+    pool.run([&](unsigned worker) {
+        SolveOptions mine = options;
+        mine.search_mode = modes[worker];
+        mine.cancel = &stop;
+        Solver solver;
+        SolveStatus status = solver.solve(map, mine, results[worker]);
+        if (status == SolveStatus::kSolved || status == SolveStatus::kNoSolution) {
+            lock_guard<mutex> lock(winner_lock);
+            if (winner == modes.size()) {
+                winner = worker;
+                stop = true;
+            }
+        }
+    });
+    // Nobody finishing means every mode was rejected or ran out of time; report the first one's status
+    result = move(results[winner == modes.size() ? 0 : winner]);
+    return result.status;
+}
+
+struct ReachabilityIndex::Data {
+    static constexpr uint32_t kNoRegion = ~uint32_t{0};
+    static constexpr uint8_t kNotButton = 0xff;
+
+    PuzzleMap const &map;
+    CellMaps maps;
+    vector<uint8_t> button_color;   // per cell; kNotButton unless a button or '^'
+    vector<uint32_t> region_of;     // per state; kNoRegion unless it can be walked on in its color
+    vector<uint8_t> region_color;
+    vector<uint64_t> press_offsets; // CSR over regions: presses out of region r are
+    vector<uint32_t> press_from;    // [press_offsets[r], press_offsets[r + 1])
+    vector<uint32_t> press_to;
+    vector<uint64_t> press_cell;    // the button cell each press happens on
+
+    // Query scratch, stamped with the query number instead of cleared
+    uint32_t epoch = 0;
+    vector<uint32_t> region_seen;
+    vector<uint32_t> region_parent; // index into press_to of the press that reached the region
+    vector<uint32_t> cell_seen;
+    vector<uint64_t> cell_parent;
+
+    explicit Data(PuzzleMap const &map) : map(map) {}
+
+    // Free to walk on in its own layer: passable and not another color's button (standing
+    // there forces a press). The map's own '@' counts as floor in every color.
+    bool walkable(uint32_t color, uint64_t cell) const {
+        if (cell == map.start.index) {
+            return true;
+        }
+        return testBit(maps.passable, color * map.layerSize() + cell + maps.pad) &&
+               (button_color[cell] == kNotButton || button_color[cell] == color);
+    }
+
+    // In-grid neighbors of a cell in N, E, S, W order as a 4-bit mask
+    uint64_t inBounds(uint64_t cell) const {
+        return (cell >= map.width) | testBit(maps.has_east, cell) << 1 |
+               (cell + map.width < map.layerSize()) << 2 | testBit(maps.has_west, cell) << 3;
+    }
+
+    void build();
+    void refine(uint32_t region, uint64_t from, uint64_t goal, bool goal_is_button, vector<Coord> &path);
+};
+
+void ReachabilityIndex::Data::build() {
+    buildCellMaps(map, maps);
+    uint64_t const layer = map.layerSize();
+    button_color.assign(layer, kNotButton);
+    vector<uint64_t> button_cells;
+    for (uint64_t cell = 0; cell < layer; ++cell) {
+        if (testBit(maps.buttons, cell)) {
+            button_color[cell] = static_cast<uint8_t>(charToNum(map.grid[cell]));
+            button_cells.push_back(cell);
+        }
+    }
+    region_of.assign(map.numStates(), kNoRegion);
+
+    // Label each layer's regions in two row-order scans instead of flood filling, which
+    // keeps memory access sequential: the first joins every walkable cell to its west and
+    // north neighbors in a union-find where every cell points at a smaller one of its set
+    // (so roots are the smallest), the second numbers each root as it comes up and gives
+    // every other cell the number of the cell it points at, which is already final.
+    vector<uint32_t> parent(layer);
+    auto find = [&parent](uint32_t cell) {
+        while (parent[cell] != cell) {
+            parent[cell] = parent[parent[cell]];
+            cell = parent[cell];
+        }
+        return cell;
+    };
+    for (uint32_t color = 0; color <= map.num_colors; ++color) {
+        uint32_t *labels = &region_of[color * layer];
+        for (uint32_t cell = 0; cell < layer; ++cell) {
+            if (!walkable(color, cell)) {
+                continue;
+            }
+            parent[cell] = cell;
+            bool west = testBit(maps.has_west, cell) && labels[cell - 1] == 0;
+            if (west) {
+                parent[cell] = parent[cell - 1];
+            }
+            // With the north-west cell walkable too, north and west are joined already
+            if (cell >= map.width && labels[cell - map.width] == 0 && !(west && labels[cell - map.width - 1] == 0)) {
+                uint32_t north = find(cell - map.width), own = find(cell);
+                parent[max(north, own)] = min(north, own);
+            }
+            labels[cell] = 0; // walkable, number to come
+        }
+        for (uint32_t cell = 0; cell < layer; ++cell) {
+            if (labels[cell] == kNoRegion) {
+                continue;
+            }
+            if (parent[cell] == cell) {
+                labels[cell] = static_cast<uint32_t>(region_color.size());
+                region_color.push_back(static_cast<uint8_t>(color));
+            } else {
+                labels[cell] = labels[parent[cell]];
+            }
+        }
+    }
+
+    // Presses: stepping from a region onto another color's button lands in the button's
+    // own layer, at whatever region holds that cell there. One per pair of regions is kept.
+    struct Press {
+        uint32_t from, to;
+        uint64_t cell;
+    };
+    vector<Press> presses;
+    for (uint64_t button : button_cells) {
+        uint32_t to_color = button_color[button];
+        uint32_t to = region_of[to_color * layer + button];
+        for (uint32_t color = 0; color <= map.num_colors; ++color) {
+            if (color == to_color) {
+                continue;
+            }
+            uint32_t last = kNoRegion;
+            for (uint64_t dirs = inBounds(button); dirs; dirs &= dirs - 1) {
+                uint32_t from = region_of[color * layer + button + moveOffset(map, __builtin_ctzll(dirs))];
+                if (from != kNoRegion && from != last) {
+                    presses.push_back(Press{from, to, button});
+                    last = from;
+                }
+            }
+        }
+    }
+    sort(presses.begin(), presses.end(), [](Press const &a, Press const &b) {
+        return a.from != b.from ? a.from < b.from : a.to != b.to ? a.to < b.to : a.cell < b.cell;
+    });
+    presses.erase(unique(presses.begin(), presses.end(),
+                         [](Press const &a, Press const &b) { return a.from == b.from && a.to == b.to; }),
+                  presses.end());
+
+    size_t num_regions = region_color.size();
+    press_offsets.assign(num_regions + 1, 0);
+    for (Press const &press : presses) {
+        ++press_offsets[press.from + 1];
+        press_from.push_back(press.from);
+        press_to.push_back(press.to);
+        press_cell.push_back(press.cell);
+    }
+    for (size_t region = 0; region < num_regions; ++region) {
+        press_offsets[region + 1] += press_offsets[region];
+    }
+    region_seen.assign(num_regions, 0);
+    region_parent.assign(num_regions, 0);
+}
+
+// BFS inside one region from cell `from` to the goal: the cell itself, or with
+// goal_is_button any cell next to that button (which is then stepped onto). Appends the
+// states after `from` to path. The goal is always there since regions are connected.
+void ReachabilityIndex::Data::refine(uint32_t region, uint64_t from, uint64_t goal, bool goal_is_button,
+                                     vector<Coord> &path) {
+    uint64_t const layer = map.layerSize();
+    uint32_t color = region_color[region];
+    if (cell_seen.empty()) {
+        cell_seen.assign(layer, 0);
+        cell_parent.assign(layer, 0);
+    }
+    ++epoch;
+    auto reached = [&](uint64_t cell) {
+        if (!goal_is_button) {
+            return cell == goal;
+        }
+        for (uint64_t dirs = inBounds(cell); dirs; dirs &= dirs - 1) {
+            if (cell + moveOffset(map, __builtin_ctzll(dirs)) == goal) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    deque<uint64_t> queue{from};
+    cell_seen[from] = epoch;
+    while (!queue.empty()) {
+        uint64_t cell = queue.front();
+        queue.pop_front();
+        if (reached(cell)) {
+            size_t first = path.size();
+            if (goal_is_button) {
+                path.push_back(Coord{color * layer + goal});
+            }
+            for (uint64_t at = cell; at != from; at = cell_parent[at]) {
+                path.push_back(Coord{color * layer + at});
+            }
+            reverse(path.begin() + static_cast<ptrdiff_t>(first), path.end());
+            return;
+        }
+        for (uint64_t dirs = inBounds(cell); dirs; dirs &= dirs - 1) {
+            uint64_t next = cell + moveOffset(map, __builtin_ctzll(dirs));
+            if (cell_seen[next] != epoch && region_of[color * layer + next] == region) {
+                cell_seen[next] = epoch;
+                cell_parent[next] = cell;
+                queue.push_back(next);
+            }
+        }
+    }
+}
+
+ReachabilityIndex::ReachabilityIndex(PuzzleMap const &map) : data(make_unique<Data>(map)) {
+    data->build();
+}
+ReachabilityIndex::~ReachabilityIndex() = default;
+ReachabilityIndex::ReachabilityIndex(ReachabilityIndex &&) noexcept = default;
+ReachabilityIndex &ReachabilityIndex::operator=(ReachabilityIndex &&) noexcept = default;
+
+uint64_t ReachabilityIndex::numRegions() const { return data->region_color.size(); }
+uint64_t ReachabilityIndex::numPresses() const { return data->press_to.size(); }
+
+SolveStatus ReachabilityIndex::query(uint64_t start_cell, uint64_t target_cell, bool want_output,
+                                     SolveResult &result) {
+    Data &d = *data;
+    PuzzleMap const &map = d.map;
+    uint64_t const layer = map.layerSize();
+    result.path.clear();
+    result.moves.clear();
+    result.discovered.clear();
+    result.expanded = 0;
+    result.reconstruct_ms = 0;
+    result.stats = SearchStats{};
+    auto isFloor = [&](uint64_t cell) {
+        char c = map.grid[cell];
+        return c == '.' || c == '@' || c == '?';
+    };
+    if (start_cell >= layer || target_cell >= layer || start_cell == target_cell ||
+        !isFloor(start_cell) || !isFloor(target_cell)) {
+        return result.status = SolveStatus::kInvalidOptions;
+    }
+    auto search_start = chrono::steady_clock::now();
+
+    // BFS over regions. The start state is (^, start); moving off it reaches exactly the
+    // region its cell has as floor, since every part of that region touches the start.
+    uint32_t first = d.region_of[start_cell];
+    uint32_t goal = Data::kNoRegion;
+    ++d.epoch;
+    auto holdsTarget = [&](uint32_t region) {
+        return d.region_of[d.region_color[region] * layer + target_cell] == region;
+    };
+    vector<uint32_t> frontier{first};
+    d.region_seen[first] = d.epoch;
+    if (holdsTarget(first)) {
+        goal = first;
+    }
+    for (size_t i = 0; i < frontier.size() && goal == Data::kNoRegion; ++i) {
+        uint32_t region = frontier[i];
+        ++result.expanded;
+        for (uint64_t edge = d.press_offsets[region]; edge < d.press_offsets[region + 1]; ++edge) {
+            uint32_t next = d.press_to[edge];
+            if (d.region_seen[next] == d.epoch) {
+                continue;
+            }
+            d.region_seen[next] = d.epoch;
+            d.region_parent[next] = static_cast<uint32_t>(edge);
+            if (holdsTarget(next)) {
+                goal = next;
+                break;
+            }
+            frontier.push_back(next);
+        }
+    }
+    result.search_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - search_start).count();
+    result.status = goal != Data::kNoRegion ? SolveStatus::kSolved : SolveStatus::kNoSolution;
+    if (!want_output) {
+        return result.status;
+    }
+
+    auto reconstruct_start = chrono::steady_clock::now();
+    if (result.status == SolveStatus::kNoSolution) {
+        // Every state of a reached region, every button stepped onto from one, and the start
+        uint32_t epoch = d.epoch;
+        result.discovered.assign((layer + 63) / 64, 0);
+        setBit(result.discovered, start_cell);
+        for (uint32_t color = 0; color <= map.num_colors; ++color) {
+            for (uint64_t cell = 0; cell < layer; ++cell) {
+                uint32_t region = d.region_of[color * layer + cell];
+                if (region == Data::kNoRegion || d.region_seen[region] != epoch) {
+                    continue;
+                }
+                setBit(result.discovered, cell);
+                for (uint64_t dirs = d.inBounds(cell); dirs; dirs &= dirs - 1) {
+                    uint64_t next = cell + moveOffset(map, __builtin_ctzll(dirs));
+                    if (d.button_color[next] != Data::kNotButton && d.button_color[next] != color) {
+                        setBit(result.discovered, next);
+                    }
+                }
+            }
+        }
+    } else {
+        // The presses on the way, then a BFS through each region from where the path came in
+        vector<uint64_t> edges;
+        for (uint32_t region = goal; region != first; region = d.press_from[edges.back()]) {
+            edges.push_back(d.region_parent[region]);
+        }
+        result.path.push_back(Coord{start_cell});
+        uint64_t cell = start_cell;
+        for (auto edge = edges.rbegin(); edge != edges.rend(); ++edge) {
+            d.refine(d.press_from[*edge], cell, d.press_cell[*edge], true, result.path);
+            cell = d.press_cell[*edge];
+            result.path.push_back(Coord{d.region_color[d.press_to[*edge]] * layer + cell});
+        }
+        d.refine(goal, cell, target_cell, false, result.path);
+    }
+    result.reconstruct_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - reconstruct_start).count();
+    return result.status;
+}
+
+PuzzleMap withEndpoints(PuzzleMap const &map, uint64_t start_cell, uint64_t target_cell) {
+    auto chars = make_shared<string>(map.layerSize(), '.');
+    for (uint64_t cell = 0; cell < map.layerSize(); ++cell) {
+        char c = map.grid[cell];
+        (*chars)[cell] = c == '@' || c == '?' ? '.' : c;
+    }
+    (*chars)[start_cell] = '@';
+    (*chars)[target_cell] = '?';
+    PuzzleMap moved = map;
+    moved.grid.view(chars->data(), map.width, map.width, chars);
+    moved.planes = nullptr; // the start moved, so layer 0 changed
+    moved.start = Coord{start_cell};
+    moved.target = Coord{target_cell};
+    return moved;
+}
+
+struct IncrementalSolver::Data {
+    static constexpr uint32_t kUnreached = ~uint32_t{0};
+
+    vector<char> chars;
+    PuzzleMap map;
+    vector<uint32_t> dist;        // per state, BFS distance from the start or kUnreached
+    vector<uint8_t> reached_in;   // per cell, number of colors it's reached in
+    vector<uint64_t> discovered;  // per cell, reached_in != 0
+    uint64_t recomputed = 0;
+
+    // Repair scratch
+    using Entry = pair<uint32_t, uint64_t>; // (distance, state)
+    priority_queue<Entry, vector<Entry>, greater<Entry>> heap;
+    vector<uint64_t> seeds;
+
+    explicit Data(PuzzleMap const &source) : map(source) {
+        chars.resize(map.layerSize());
+        for (uint64_t cell = 0; cell < chars.size(); ++cell) {
+            chars[cell] = source.grid[cell];
+        }
+        map.grid.view(chars.data(), map.width, map.width, nullptr);
+        map.planes = nullptr; // edits would make them stale
+    }
+
+    uint64_t source() const { return map.start.index; }
+
+    // The state of another color's button has a single way out: the press
+    uint32_t forcedPress(uint32_t color, uint64_t cell) const {
+        char c = chars[cell];
+        uint32_t button = islower(c) || c == '^' ? charToNum(c) : kNoColor;
+        return button != color ? button : kNoColor;
+    }
+
+    // In-grid neighbors of a cell in N, E, S, W order as a 4-bit mask
+    uint64_t inBounds(uint64_t cell) const {
+        uint64_t column = cell % map.width;
+        return (cell >= map.width) | uint64_t{column + 1 < map.width} << 1 |
+               uint64_t{cell + map.width < map.layerSize()} << 2 | uint64_t{column > 0} << 3;
+    }
+
+    // Calls f(next) for every move out of state (the current grid's edges)
+    template <class F>
+    void forEachSuccessor(uint64_t state, F f) const {
+        uint64_t const layer = map.layerSize();
+        uint32_t color = static_cast<uint32_t>(state / layer);
+        uint64_t cell = state - color * layer;
+        uint32_t press = forcedPress(color, cell);
+        if (press != kNoColor) {
+            f(press * layer + cell);
+            return;
+        }
+        for (uint64_t dirs = inBounds(cell); dirs; dirs &= dirs - 1) {
+            int64_t offset = moveOffset(map, __builtin_ctzll(dirs));
+            if (passableIn(chars[cell + offset], color)) {
+                f(state + offset);
+            }
+        }
+    }
+
+    // Calls f(previous) for every move into state
+    template <class F>
+    void forEachPredecessor(uint64_t state, F f) const {
+        uint64_t const layer = map.layerSize();
+        uint32_t color = static_cast<uint32_t>(state / layer);
+        uint64_t cell = state - color * layer;
+        if (!passableIn(chars[cell], color)) {
+            return;
+        }
+        for (uint64_t dirs = inBounds(cell); dirs; dirs &= dirs - 1) {
+            int64_t offset = moveOffset(map, __builtin_ctzll(dirs));
+            if (forcedPress(color, cell + offset) == kNoColor) {
+                f(state + offset);
+            }
+        }
+        char c = chars[cell];
+        if ((islower(c) || c == '^') && charToNum(c) == color) {
+            for (uint32_t from = 0; from <= map.num_colors; ++from) {
+                if (from != color) {
+                    f(from * layer + cell);
+                }
+            }
+        }
+    }
+
+    void setDist(uint64_t state, uint32_t d) {
+        uint64_t cell = state % map.layerSize();
+        if (dist[state] == kUnreached && d != kUnreached && reached_in[cell]++ == 0) {
+            setBit(discovered, cell);
+        } else if (dist[state] != kUnreached && d == kUnreached && --reached_in[cell] == 0) {
+            clearBit(discovered, cell);
+        }
+        dist[state] = d;
+    }
+
+    // Plain BFS over every reachable state
+    void solveFully() {
+        dist.assign(map.numStates(), kUnreached);
+        reached_in.assign(map.layerSize(), 0);
+        discovered.assign((map.layerSize() + 63) / 64, 0);
+        deque<uint64_t> queue{source()};
+        setDist(source(), 0);
+        while (!queue.empty()) {
+            uint64_t state = queue.front();
+            queue.pop_front();
+            ++recomputed;
+            forEachSuccessor(state, [&](uint64_t next) {
+                if (dist[next] == kUnreached) {
+                    setDist(next, dist[state] + 1);
+                    queue.push_back(next);
+                }
+            });
+        }
+    }
+
+    void repair(uint64_t cell);
+};
+
+// Only edges into the edited cell's states and its neighbors' states can have appeared
+// or gone. First every state whose distance lost all support (no predecessor one closer)
+// is unreached again, in increasing order of the old distances so a predecessor is always
+// settled before the states it supports. Then the distances of those states and of the
+// edited neighborhood are rebuilt from their predecessors and pushed outward Dijkstra
+// style, which also carries any shortcut a new edge opened.
+void IncrementalSolver::Data::repair(uint64_t cell) {
+    uint64_t const layer = map.layerSize();
+    seeds.clear();
+    for (uint32_t color = 0; color <= map.num_colors; ++color) {
+        seeds.push_back(color * layer + cell);
+        for (uint64_t dirs = inBounds(cell); dirs; dirs &= dirs - 1) {
+            seeds.push_back(color * layer + cell + moveOffset(map, __builtin_ctzll(dirs)));
+        }
+    }
+    for (uint64_t state : seeds) {
+        if (dist[state] != kUnreached && state != source()) {
+            heap.emplace(dist[state], state);
+        }
+    }
+    while (!heap.empty()) {
+        auto [d, state] = heap.top();
+        heap.pop();
+        if (dist[state] != d) {
+            continue;
+        }
+        ++recomputed;
+        bool supported = false;
+        forEachPredecessor(state, [&](uint64_t previous) { supported |= dist[previous] == d - 1; });
+        if (supported) {
+            continue;
+        }
+        setDist(state, kUnreached);
+        seeds.push_back(state);
+        forEachSuccessor(state, [&](uint64_t next) {
+            if (dist[next] == d + 1) {
+                heap.emplace(d + 1, next);
+            }
+        });
+    }
+
+    for (uint64_t state : seeds) {
+        uint32_t best = state == source() ? 0 : kUnreached;
+        forEachPredecessor(state, [&](uint64_t previous) {
+            if (dist[previous] != kUnreached) {
+                best = min(best, dist[previous] + 1);
+            }
+        });
+        if (best < dist[state]) {
+            setDist(state, best);
+            heap.emplace(best, state);
+        }
+    }
+    while (!heap.empty()) {
+        auto [d, state] = heap.top();
+        heap.pop();
+        if (dist[state] != d) {
+            continue;
+        }
+        ++recomputed;
+        forEachSuccessor(state, [&](uint64_t next) {
+            if (d + 1 < dist[next]) {
+                setDist(next, d + 1);
+                heap.emplace(d + 1, next);
+            }
+        });
+    }
+}
+
+IncrementalSolver::IncrementalSolver(PuzzleMap const &map) : data(make_unique<Data>(map)) {
+    data->solveFully();
+}
+
+IncrementalSolver::~IncrementalSolver() = default;
+IncrementalSolver::IncrementalSolver(IncrementalSolver &&) noexcept = default;
+IncrementalSolver &IncrementalSolver::operator=(IncrementalSolver &&) noexcept = default;
+
+PuzzleMap const &IncrementalSolver::map() const { return data->map; }
+
+bool IncrementalSolver::edit(uint64_t cell, char c) {
+    Data &d = *data;
+    if (cell >= d.map.layerSize() || !isValidChar(c, d.map.num_colors)) {
+        return false;
+    }
+    char old = d.chars[cell];
+    if (old == '@' || old == '?') {
+        return c == old;
+    }
+    if (c == '@') {
+        d.chars[d.source()] = '.';
+        d.chars[cell] = '@';
+        d.map.start = Coord{cell};
+        d.solveFully();
+        return true;
+    }
+    if (c == '?') {
+        // '?' and '.' are passable alike, so the old target cell needs no repair
+        d.chars[d.map.target.index] = '.';
+        d.map.target = Coord{cell};
+    }
+    if (old != c) {
+        d.chars[cell] = c;
+        d.repair(cell);
+    }
+    return true;
+}
+
+SolveStatus IncrementalSolver::solve(SolveResult &result) {
+    Data &d = *data;
+    auto start = chrono::steady_clock::now();
+    result.path.clear();
+    result.moves.clear();
+    result.discovered.clear();
+    result.search_ms = 0;
+    result.stats = SearchStats{};
+    result.search_mode = SearchMode::kQueue;
+    result.expanded = d.recomputed;
+    d.recomputed = 0;
+    result.visited = VisitedStore::kDense;
+    result.visited_bytes = d.dist.size() * sizeof(uint32_t);
+
+    uint64_t const layer = d.map.layerSize();
+    uint64_t goal = d.map.target.index;
+    for (uint32_t color = 1; color <= d.map.num_colors; ++color) {
+        if (d.dist[color * layer + d.map.target.index] < d.dist[goal]) {
+            goal = color * layer + d.map.target.index;
+        }
+    }
+    if (d.dist[goal] == Data::kUnreached) {
+        result.discovered = d.discovered;
+        result.reconstruct_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        return result.status = SolveStatus::kNoSolution;
+    }
+    // Back from the target, each step to any predecessor one closer to the start
+    for (uint64_t state = goal;;) {
+        result.path.push_back(Coord{state});
+        if (state == d.source()) {
+            break;
+        }
+        uint64_t previous = state;
+        d.forEachPredecessor(state, [&](uint64_t p) {
+            if (previous == state && d.dist[p] == d.dist[state] - 1) {
+                previous = p;
+            }
+        });
+        state = previous;
+    }
+    reverse(result.path.begin(), result.path.end());
+    result.reconstruct_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    return result.status = SolveStatus::kSolved;
+}
+
+// Cache entry layout (native byte order): this header, then for a solved entry one
+// moveRunCode varint per run, or for an unsolvable one the discovered bitmap's words. The
+// checksum covers the header (with checksum = 0) and the payload.
+struct CacheHeader {
+    char magic[8];     // "PZLSOL01"
+    uint64_t map_hash; // mapHash() of the puzzle
+    uint32_t num_colors;
+    uint32_t height;
+    uint32_t width;
+    uint32_t search_mode;
+    uint32_t solved;   // 1 = moves follow, 0 = the discovered bitmap
+    uint32_t reserved;
+    uint64_t payload_bytes;
+    uint64_t checksum;
+};
+char const kCacheMagic[8] = {'P', 'Z', 'L', 'S', 'O', 'L', '0', '1'};
+
+uint64_t checksumCacheEntry(CacheHeader header, string const &payload) {
+    header.checksum = 0;
+    uint64_t hash = checksumBytes(0, reinterpret_cast<char const *>(&header), sizeof header);
+    return checksumBytes(hash, payload.data(), payload.size());
+}
+
+// Walks moves from the start and checks each is one the searches could have made: a press
+// only on a button of another color, and nothing else there; steps only onto cells open
+// in the current color; the target reached at the very end and not before. The states
+// go into path when it's given.
+bool replayMoves(PuzzleMap const &map, vector<MoveRun> const &moves, vector<Coord> *path) {
+    uint32_t color = map.colorOf(map.start);
+    uint64_t cell = map.cellOf(map.start);
+    if (path) {
+        path->assign(1, map.start);
+    }
+    auto isButton = [](char c) { return islower(static_cast<unsigned char>(c)) || c == '^'; };
+    for (MoveRun const &run : moves) {
+        for (uint64_t step = 0; step < run.count; ++step) {
+            char here = map.grid[cell];
+            if (cell == map.target.index) {
+                return false;
+            }
+            if (!isupper(static_cast<unsigned char>(run.move))) {
+                if (!isButton(here) || charToNum(here) != charToNum(run.move) || charToNum(here) == color) {
+                    return false;
+                }
+                color = charToNum(here);
+            } else {
+                if (isButton(here) && charToNum(here) != color) {
+                    return false;
+                }
+                uint64_t row = cell / map.width, column = cell % map.width;
+                bool inside = run.move == 'N' ? row > 0 : run.move == 'S' ? row + 1 < map.height
+                            : run.move == 'E' ? column + 1 < map.width : column > 0;
+                if (!inside) {
+                    return false;
+                }
+                cell = run.move == 'N' ? cell - map.width : run.move == 'S' ? cell + map.width
+                     : run.move == 'E' ? cell + 1 : cell - 1;
+                if (!passableIn(map.grid[cell], color)) {
+                    return false;
+                }
+            }
+            if (path) {
+                path->push_back(Coord{color * map.layerSize() + cell});
+            }
+        }
+    }
+    return cell == map.target.index;
+}
+
+struct SolutionCache::Data {
+    string directory;
+    uint64_t max_bytes;
+    atomic<uint64_t> hits{0};
+    atomic<uint64_t> misses{0};
+    atomic<uint64_t> evicted{0};
+
+    // Guards the size estimate and eviction
+    mutex lock;
+    bool scanned = false; // bytes holds a full scan plus what was stored since
+    uint64_t bytes = 0;
+
+    Data(string dir, uint64_t max) : directory(move(dir)), max_bytes(max) {}
+
+    // "<hash of the map and mode as 16 hex digits>.sol"
+    string pathOf(PuzzleMap const &map, SearchMode mode, uint64_t &map_hash) const {
+        map_hash = mapHash(map);
+        uint32_t const mode_number = static_cast<uint32_t>(mode);
+        uint64_t key = checksumBytes(map_hash, reinterpret_cast<char const *>(&mode_number), sizeof mode_number);
+        char name[32];
+        snprintf(name, sizeof name, "%016llx.sol", static_cast<unsigned long long>(key));
+        return directory + "/" + name;
+    }
+
+    bool read(string const &path, PuzzleMap const &map, SearchMode mode, uint64_t map_hash,
+              SolveOptions const &options, SolveResult &result);
+    void trim();
+};
+
+// Reads and checks one entry into result; false if it's missing, corrupt or not for this map
+bool SolutionCache::Data::read(string const &path, PuzzleMap const &map, SearchMode mode, uint64_t map_hash,
+                               SolveOptions const &options, SolveResult &result) {
+    ifstream in(path, ios::binary);
+    CacheHeader header{};
+    if (!in.read(reinterpret_cast<char *>(&header), sizeof header)) {
+        return false;
+    }
+    uint64_t const words = (map.layerSize() + 63) / 64;
+    in.seekg(0, ios::end);
+    uint64_t const file_bytes = static_cast<uint64_t>(in.tellg());
+    bool const fits = memcmp(header.magic, kCacheMagic, sizeof header.magic) == 0 && header.map_hash == map_hash &&
+                      header.num_colors == map.num_colors && header.height == map.height &&
+                      header.width == map.width && header.search_mode == static_cast<uint32_t>(mode) &&
+                      header.solved <= 1 && header.payload_bytes == file_bytes - sizeof header &&
+                      (header.solved || header.payload_bytes == words * sizeof(uint64_t));
+    if (!fits) {
+        return false;
+    }
+    string payload(header.payload_bytes, '\0');
+    in.seekg(sizeof header);
+    if (!in.read(&payload[0], static_cast<streamsize>(payload.size())) ||
+        checksumCacheEntry(header, payload) != header.checksum) {
+        return false;
+    }
+
+    if (!header.solved) {
+        result.discovered.resize(words);
+        memcpy(result.discovered.data(), payload.data(), payload.size());
+        result.status = SolveStatus::kNoSolution;
+        return true;
+    }
+    vector<MoveRun> &moves = result.moves;
+    for (size_t at = 0; at < payload.size();) {
+        uint64_t value = 0;
+        for (int shift = 0;; shift += 7) {
+            if (at == payload.size() || shift > 63) {
+                return false;
+            }
+            uint8_t byte = static_cast<uint8_t>(payload[at++]);
+            value |= uint64_t{byte & 0x7fu} << shift;
+            if (!(byte & 0x80)) {
+                break;
+            }
+        }
+        uint64_t code = value & 7, count = value >> 3;
+        if (code < 4 && count != 0) {
+            moves.push_back(MoveRun{"NESW"[code], count});
+        } else if (code == 4 && count <= map.num_colors) {
+            moves.push_back(MoveRun{numToChar(static_cast<uint32_t>(count)), 1});
+        } else {
+            return false;
+        }
+    }
+    if (!replayMoves(map, moves, options.path_format == PathFormat::kMoves ? nullptr : &result.path)) {
+        return false;
+    }
+    if (options.path_format != PathFormat::kMoves) {
+        moves.clear();
+    }
+    result.status = SolveStatus::kSolved;
+    return true;
+}
+
+// Adds up the entries on disk and, past max_bytes, removes the least recently used ones
+// (oldest modification time; a hit touches its entry) down to 90% of it, so the next few
+// stores don't each have to scan again
+void SolutionCache::Data::trim() {
+    struct Entry {
+        filesystem::file_time_type time;
+        uint64_t size;
+        filesystem::path path;
+    };
+    vector<Entry> entries;
+    error_code ec;
+    bytes = 0;
+    for (auto const &entry : filesystem::directory_iterator(directory, ec)) {
+        error_code entry_ec;
+        if (entry.path().extension() != ".sol" || !entry.is_regular_file(entry_ec)) {
+            continue;
+        }
+        uint64_t size = entry.file_size(entry_ec);
+        auto time = entry.last_write_time(entry_ec);
+        if (!entry_ec) {
+            entries.push_back(Entry{time, size, entry.path()});
+            bytes += size;
+        }
+    }
+    scanned = true;
+    if (bytes <= max_bytes) {
+        return;
+    }
+    sort(entries.begin(), entries.end(), [](Entry const &a, Entry const &b) { return a.time < b.time; });
+    for (Entry const &entry : entries) {
+        if (bytes <= max_bytes / 10 * 9) {
+            break;
+        }
+        if (filesystem::remove(entry.path, ec)) {
+            ++evicted;
+        }
+        bytes -= entry.size;
+    }
+}
+
+SolutionCache::SolutionCache(string directory, uint64_t max_bytes)
+    : data(make_unique<Data>(move(directory), max_bytes)) {}
+SolutionCache::~SolutionCache() = default;
+SolutionCache::SolutionCache(SolutionCache &&) noexcept = default;
+SolutionCache &SolutionCache::operator=(SolutionCache &&) noexcept = default;
+
+bool SolutionCache::lookup(PuzzleMap const &map, SolveOptions const &options, SolveResult &result) {
+    auto start = chrono::steady_clock::now();
+    result.search_mode = options.search_mode;
+    result.path.clear();
+    result.moves.clear();
+    result.discovered.clear();
+    result.expanded = 0;
+    result.search_ms = 0;
+    result.visited = VisitedStore::kDense;
+    result.visited_bytes = 0;
+    result.pruned_cells = 0;
+    result.stats = SearchStats{};
+
+    uint64_t map_hash = 0;
+    string path = data->pathOf(map, options.search_mode, map_hash);
+    error_code ec;
+    if (!filesystem::exists(path, ec)) {
+        ++data->misses;
+        return false;
+    }
+    if (!data->read(path, map, options.search_mode, map_hash, options, result)) {
+        result.path.clear();
+        result.moves.clear();
+        result.discovered.clear();
+        filesystem::remove(path, ec);
+        ++data->misses;
+        return false;
+    }
+    // Most recently used now, for eviction
+    filesystem::last_write_time(path, filesystem::file_time_type::clock::now(), ec);
+    if (options.stats && result.status == SolveStatus::kSolved) {
+        countPathPresses(map, result);
+    }
+    result.reconstruct_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    ++data->hits;
+    return true;
+}
+
+bool SolutionCache::store(PuzzleMap const &map, SolveOptions const &options, SolveResult const &result) {
+    if (result.status != SolveStatus::kSolved && result.status != SolveStatus::kNoSolution) {
+        return false;
+    }
+    CacheHeader header{};
+    memcpy(header.magic, kCacheMagic, sizeof header.magic);
+    string path = data->pathOf(map, options.search_mode, header.map_hash);
+    header.num_colors = map.num_colors;
+    header.height = map.height;
+    header.width = map.width;
+    header.search_mode = static_cast<uint32_t>(options.search_mode);
+    header.solved = result.status == SolveStatus::kSolved;
+
+    string payload;
+    if (header.solved) {
+        vector<MoveRun> encoded;
+        if (result.moves.empty()) {
+            encodeMoves(map, result.path, encoded);
+        }
+        for (MoveRun const &run : result.moves.empty() ? encoded : result.moves) {
+            appendVarint(payload, moveRunCode(run));
+        }
+    } else {
+        payload.assign(reinterpret_cast<char const *>(result.discovered.data()),
+                       result.discovered.size() * sizeof(uint64_t));
+    }
+    header.payload_bytes = payload.size();
+    header.checksum = checksumCacheEntry(header, payload);
+
+    // Written under a unique name and renamed into place, so readers only ever see whole entries
+    error_code ec;
+    filesystem::create_directories(data->directory, ec);
+    string temporary = data->directory + "/.entry-XXXXXX";
+    int fd = mkstemp(&temporary[0]);
+    if (fd < 0) {
+        return false;
+    }
+    bool written = ::write(fd, &header, sizeof header) == static_cast<ssize_t>(sizeof header);
+    for (size_t done = 0; written && done < payload.size();) {
+        ssize_t n = ::write(fd, payload.data() + done, payload.size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        written = n > 0;
+        done += written ? static_cast<size_t>(n) : 0;
+    }
+    written = close(fd) == 0 && written;
+    if (!written || rename(temporary.c_str(), path.c_str()) != 0) {
+        unlink(temporary.c_str());
+        return false;
+    }
+
+    if (data->max_bytes != 0) {
+        lock_guard<mutex> guard(data->lock);
+        data->bytes += sizeof header + payload.size();
+        if (!data->scanned || data->bytes > data->max_bytes) {
+            data->trim();
+        }
+    }
+    return true;
+}
+
+uint64_t SolutionCache::hits() const { return data->hits; }
+uint64_t SolutionCache::misses() const { return data->misses; }
+uint64_t SolutionCache::evicted() const { return data->evicted; }
@@ -0,0 +1,362 @@
+// Identifier: A8A3A33EF075ACEF9B08F5B9845569ECCB423725
+// Puzzle solver library: load a puzzle, solve it with a reusable Solver and render the
+// result. Nothing in here exits or touches cin/cout/cerr on its own; failures come back as
+// codes along with the message text the command line tool prints for them.
+#ifndef PUZZLE_SOLVER_H
+#define PUZZLE_SOLVER_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Colors are numbered 0 for '^' and 1..26 for 'a'..'z' (buttons) and 'A'..'Z' (doors)
+uint32_t const kNoColor = ~uint32_t{0};
+uint32_t charToNum(char c);   // kNoColor for a char that names no color
+char numToChar(uint32_t num); // '\0' for a number that names no color
+bool isValidChar(char c, uint32_t num_colors);
+
+// A search state packed into one index: (color * height + row) * width + column.
+// Moving north/south is -/+ width, east/west is +/- 1 and pressing a button
+// jumps whole layers of height * width states.
+struct Coord {
+    uint64_t index;
+
+    // Initializer
+    Coord(uint64_t i) : index(i) {};
+
+};
+
+// The map's chars indexed by cell (row * width + column). Usually a view straight into
+// the input bytes, where rows sit `stride` bytes apart with their line endings in between;
+// owner keeps those bytes alive (or is a compact copy when the rows weren't evenly spaced).
+class Grid {
+public:
+    void view(char const *first_row, uint64_t row_stride, uint32_t row_width, std::shared_ptr<void const> keep_alive) {
+        data = first_row;
+        stride = row_stride;
+        width = row_width;
+        owner = std::move(keep_alive);
+    }
+
+    char operator[](uint64_t cell) const {
+        return stride == width ? data[cell] : data[(cell / width) * stride + cell % width];
+    }
+    char const *row(uint64_t r) const { return data + r * stride; }
+
+private:
+    char const *data = nullptr;
+    uint64_t stride = 0;
+    uint64_t width = 0;
+    std::shared_ptr<void const> owner;
+};
+
+struct PuzzleMap {
+    uint32_t num_colors = 0;
+    uint32_t height = 0;
+    uint32_t width = 0;
+
+    Grid grid;
+    Coord start{0}, target{0}; // Both live in color '^' (layer 0)
+    // Passable planes stored in a binary puzzle file, null otherwise: colors 0..num_colors
+    // one after another, (layerSize() + 63) / 64 words each. Kept alive by the grid's owner.
+    uint64_t const *planes = nullptr;
+
+    uint64_t layerSize() const { return static_cast<uint64_t>(height) * width; }
+    uint64_t numStates() const { return (num_colors + 1) * layerSize(); }
+
+    Coord coordOf(uint32_t color, uint32_t row, uint32_t column) const {
+        return Coord{(color * static_cast<uint64_t>(height) + row) * width + column};
+    }
+    uint32_t colorOf(Coord c) const { return static_cast<uint32_t>(c.index / layerSize()); }
+    uint64_t cellOf(Coord c) const { return c.index % layerSize(); }
+    uint32_t rowOf(Coord c) const { return static_cast<uint32_t>(cellOf(c) / width); }
+    uint32_t columnOf(Coord c) const { return static_cast<uint32_t>(c.index % width); }
+    char cellAt(Coord c) const { return grid[cellOf(c)]; }
+};
+
+// Why a puzzle failed to load; the message that comes with it is the exact line the
+// command line tool prints
+enum class ParseError {
+    kNone,
+    kMissingSize,   // no "num_colors height width" header
+    kColorCount,    // num_colors over 26
+    kSize,          // height or width of 0
+    kInvalidChar,   // a char that's not allowed with this many colors
+    kStartTarget,   // not exactly one '@' and one '?'
+    kFile,          // the file couldn't be opened, read or mapped
+    kBinary,        // a binary puzzle that's truncated, has unknown flags or fails its checksum
+};
+
+// Binary puzzle files start with this magic instead of a "num_colors height width" line.
+// The cells are stored a byte each, so the grid is a view of the mapped file like it is
+// for text, and they're only covered by the checksum: nothing re-validates them, so load
+// only files this library wrote.
+enum class PuzzleFormat {
+    kText,
+    kBinary,
+};
+bool isBinaryPuzzle(char const *begin, char const *end);
+
+// Parses a puzzle from raw bytes, text or binary. The grid is a view of the bytes when it can be, and
+// owner is kept alive by the map; pass a null owner only if the bytes outlive the map.
+// On error map is left alone and message is set.
+ParseError parsePuzzle(char const *begin, char const *end, std::shared_ptr<void const> owner,
+                       PuzzleMap &map, std::string &message);
+// Reads the whole stream, then parses it
+ParseError readPuzzle(std::istream &in, PuzzleMap &map, std::string &message);
+// Memory-maps the file and parses it in place
+ParseError readPuzzleFile(std::string const &path, PuzzleMap &map, std::string &message);
+// Writes map back out in either format; with_planes also stores the passable planes in a
+// binary file, so solving it skips building them. Comment lines are not kept. False if
+// the stream failed.
+bool writePuzzle(PuzzleMap const &map, PuzzleFormat format, bool with_planes, std::ostream &out);
+
+enum class SearchMode {
+    kNone,
+    kQueue,
+    kStack,
+    kAStar,
+    kBidirectional,
+    kRuns, // BFS over whole row runs of floor instead of cells (path isn't always the shortest)
+};
+// "queue", "stack", "astar", "bidirectional", "runs" (the command line option names), or "none"
+char const *searchModeName(SearchMode mode);
+
+// Where the search keeps its per-state visited/backtrace codes
+enum class VisitedStore {
+    kAuto,   // pick from the map's size (see Solver::solve)
+    kDense,  // one array over every state: fastest, but sized for all num_colors + 1 layers
+    kLazy,   // the same array in pages allocated as states in them are discovered
+    kSparse, // a hash table of discovered states only
+    kStriped, // on disk in stripes of rows; only the mem_limit search uses it, never picked
+};
+
+// How Solver::solve hands back a solved path
+enum class PathFormat {
+    kStates, // SolveResult::path, one Coord per state
+    kMoves,  // SolveResult::moves only, run-length encoded and built without the per-state path
+};
+
+// One entry of SolveResult::moves
+struct MoveRun {
+    char move;      // 'N', 'E', 'S' or 'W', or for a button press the new color's char
+    uint64_t count; // steps in a row that way; always 1 for a press
+};
+
+struct SolveOptions {
+    SearchMode search_mode = SearchMode::kQueue;
+    unsigned threads = 0; // 0 = plain single-threaded search, otherwise a parallel BFS (kQueue only)
+    bool stats = false;   // fill in SolveResult::stats
+    VisitedStore visited = VisitedStore::kAuto; // threads need kDense (kAuto picks it)
+    // Nonzero runs the kQueue search out of core in about this many bytes: the backtrace
+    // and the frontier go to temporary files in spill_dir ($TMPDIR or /tmp if empty)
+    uint64_t mem_limit = 0;
+    std::string spill_dir{};
+    // Polled every few thousand states; once it's true the search stops and solve returns
+    // kCancelled. Not with threads or mem_limit, and neither are the next three.
+    std::atomic<bool> const *cancel = nullptr;
+    // Seconds the search may run (0 = no limit), not counting loading a checkpoint; past it
+    // the search stops and solve returns kTimedOut
+    double time_limit = 0;
+    // kQueue or kStack only: a file the search is saved to when time_limit runs out, and
+    // resumed from by the next solve of the same map and options if it exists. It's
+    // removed once a resumed search finishes.
+    std::string checkpoint{};
+    // Called about once a second while searching, with the states expanded so far and the
+    // state-space bound (numStates())
+    std::function<void(uint64_t expanded, uint64_t bound)> progress{};
+    PathFormat path_format = PathFormat::kStates;
+    // Peel dead-end pockets off the map before searching (ignored with mem_limit). The
+    // no-solution report and the kQueue, kStack and kAStar paths come out the same; only
+    // the search internals shrink.
+    bool prune = false;
+};
+
+// Search internals, counted only when SolveOptions::stats is set
+struct SearchStats {
+    uint64_t expanded[27] = {};   // per color layer
+    uint64_t discovered[27] = {}; // per color layer, counted from the backtrace afterwards
+    uint64_t peak_container = 0;  // most states waiting in the search container at once
+    uint64_t presses = 0;         // button presses explored, not counting traps
+    uint64_t trap_presses = 0;    // presses of a '^' explored
+    uint64_t path_presses = 0;
+    uint64_t path_trap_presses = 0;
+
+    void expand(uint32_t color) { ++expanded[color]; }
+    void press(uint32_t new_color) { ++(new_color == 0 ? trap_presses : presses); }
+    void container(uint64_t size) { peak_container = size > peak_container ? size : peak_container; }
+    void merge(SearchStats const &other) {
+        for (uint32_t color = 0; color < 27; ++color) {
+            expanded[color] += other.expanded[color];
+        }
+        presses += other.presses;
+        trap_presses += other.trap_presses;
+    }
+};
+
+enum class SolveStatus {
+    kSolved,
+    kNoSolution,
+    kInvalidOptions, // no search mode, threads with anything but kQueue, or threads without kDense,
+                     // or mem_limit with anything but a single-threaded kQueue and kAuto, or cancel,
+                     // time_limit or checkpoint with threads or mem_limit, or checkpoint with
+                     // anything but kQueue and kStack
+    kSpillFailed,    // the mem_limit search couldn't create, read or write its temporary files
+    kCancelled,      // SolveOptions::cancel was set before the search finished
+    kTimedOut,       // SolveOptions::time_limit ran out (the checkpoint, if any, holds the search)
+    kCheckpointFailed, // the checkpoint couldn't be written, or couldn't be read back for this map
+                       // and these options
+};
+
+struct SolveResult {
+    SolveStatus status = SolveStatus::kNoSolution;
+    SearchMode search_mode = SearchMode::kNone; // the search that produced this result
+    std::vector<Coord> path;          // start first, target last; empty unless kSolved
+    std::vector<MoveRun> moves;       // from the start on, instead of path with PathFormat::kMoves
+    std::vector<uint64_t> discovered; // one bit per cell, set if reached in any color; kNoSolution only
+    uint64_t expanded = 0;
+    double search_ms = 0;
+    double reconstruct_ms = 0;
+    VisitedStore visited = VisitedStore::kDense; // the store actually used
+    uint64_t visited_bytes = 0;                  // its size when the search ended
+    uint64_t pruned_cells = 0;                   // dead-end cells SolveOptions::prune closed
+    SearchStats stats;
+
+    bool discoveredCell(uint64_t cell) const { return (discovered[cell / 64] >> (cell % 64)) & 1; }
+    uint64_t pathLength() const; // states on the path, start and target included, in either form
+};
+
+// Solves puzzles one after another. The bitmaps, backtrace and search containers stay
+// allocated between calls, and so do the vectors of a result that's passed in again.
+class Solver {
+public:
+    Solver();
+    ~Solver();
+    Solver(Solver &&) noexcept;
+    Solver &operator=(Solver &&) noexcept;
+
+    SolveStatus solve(PuzzleMap const &map, SolveOptions const &options, SolveResult &result);
+
+private:
+    struct Buffers;
+    std::unique_ptr<Buffers> buffers;
+};
+
+// Races one Solver per mode, each on its own thread over the same read-only map, and keeps
+// whichever finishes first, solved or proven unsolvable (result.search_mode says which).
+// The others are cancelled through SolveOptions::cancel and joined before this returns.
+// Every other option applies to each search alike; kInvalidOptions if modes is empty or
+// options has threads, mem_limit, cancel or checkpoint set.
+SolveStatus solvePortfolio(PuzzleMap const &map, std::vector<SearchMode> const &modes,
+                           SolveOptions const &options, SolveResult &result);
+
+// Connected regions of every color layer plus the button presses leading from one region
+// into another, built once per grid. Start/target queries then walk that region graph
+// instead of every state. The grid's own '@' and '?' count as floor here; a query puts
+// its start and target on any two distinct floor cells ('.', '@' or '?'). The map must
+// outlive the index.
+class ReachabilityIndex {
+public:
+    explicit ReachabilityIndex(PuzzleMap const &map);
+    ~ReachabilityIndex();
+    ReachabilityIndex(ReachabilityIndex &&) noexcept;
+    ReachabilityIndex &operator=(ReachabilityIndex &&) noexcept;
+
+    uint64_t numRegions() const;
+    uint64_t numPresses() const; // region to region press edges
+
+    // Fills result.status and result.expanded (regions visited). With want_output also
+    // result.path (a valid path, fewest presses but not always fewest moves) when
+    // solved, or result.discovered when not. kInvalidOptions if either cell is off the
+    // grid, not floor, or both are the same.
+    SolveStatus query(uint64_t start_cell, uint64_t target_cell, bool want_output, SolveResult &result);
+
+private:
+    struct Data;
+    std::unique_ptr<Data> data;
+};
+
+// Solves one map again and again while it's edited a cell at a time. It keeps the BFS
+// distance of every state (4 bytes each) and after an edit re-derives only the distances
+// that depended on the changed cell, so a local edit costs a small part of a full search.
+// Paths are shortest ones, but ties may break differently than SearchMode::kQueue.
+class IncrementalSolver {
+public:
+    explicit IncrementalSolver(PuzzleMap const &map); // copies the grid, then runs one full BFS
+    ~IncrementalSolver();
+    IncrementalSolver(IncrementalSolver &&) noexcept;
+    IncrementalSolver &operator=(IncrementalSolver &&) noexcept;
+
+    PuzzleMap const &map() const; // the map as edited so far, for rendering results
+
+    // Sets one cell to c. '@' or '?' moves the start or target there (the old cell becomes
+    // '.'); moving the start recomputes everything. False, with nothing changed, if the
+    // cell is off the grid, c isn't valid for the map, or the cell holds the '@' or '?'.
+    bool edit(uint64_t cell, char c);
+
+    // Fills result like Solver::solve for the current map; result.expanded counts the
+    // states the edits since the last call recomputed
+    SolveStatus solve(SolveResult &result);
+
+private:
+    struct Data;
+    std::unique_ptr<Data> data;
+};
+
+// Finished results on disk, one file per map and search mode in a directory. Entries are
+// keyed by a hash of the parsed map (size, start, target and every cell), so a text and a
+// binary copy of a puzzle share them, and nothing else in SolveOptions is part of the key:
+// a path is the one the search that stored it found. Solved entries hold the moves as
+// varints, unsolvable ones the discovered bitmap. Safe to share between threads and
+// between processes using the same directory.
+class SolutionCache {
+public:
+    // max_bytes bounds the directory's entries (0 = no bound); past it the least recently
+    // used ones are removed. The directory is created by the first store.
+    SolutionCache(std::string directory, uint64_t max_bytes);
+    ~SolutionCache();
+    SolutionCache(SolutionCache &&) noexcept;
+    SolutionCache &operator=(SolutionCache &&) noexcept;
+
+    // Fills result like Solver::solve would (path or moves per options.path_format) from
+    // the entry for map and options.search_mode. A solved entry's moves are replayed on the
+    // map first; one that's corrupt or doesn't hold up is removed and counts as a miss.
+    bool lookup(PuzzleMap const &map, SolveOptions const &options, SolveResult &result);
+    // Saves a kSolved or kNoSolution result under options.search_mode, then evicts if the
+    // directory grew past max_bytes. False if it couldn't be written.
+    bool store(PuzzleMap const &map, SolveOptions const &options, SolveResult const &result);
+
+    uint64_t hits() const;
+    uint64_t misses() const;
+    uint64_t evicted() const; // entries removed to stay under max_bytes
+
+private:
+    struct Data;
+    std::unique_ptr<Data> data;
+};
+
+// A copy of map with '@' and '?' moved to these cells (the old ones become '.'), for
+// rendering an index query's result
+PuzzleMap withEndpoints(PuzzleMap const &map, uint64_t start_cell, uint64_t target_cell);
+
+// Output in the formats the command line tool prints. Stdout gets a few large writev
+// calls; any other stream gets plain writes.
+void generateListOutput(PuzzleMap const &map, SolveResult const &result, std::ostream &out);
+// Layers render in parallel on up to render_threads threads when the map is big enough
+void generateMapOutput(PuzzleMap const &map, SolveResult const &result, unsigned render_threads,
+                       std::ostream &out);
+// The start state as "(^, (row, col))", then the moves as space separated runs such as "3E",
+// "W" (a count of 1 is left out) or "b" (press, now in color b), 64 to a line. The binary
+// form is a 24-byte header ("PZLMOV01", start row and column as u32, run count as u64, all
+// little-endian), then one LEB128 varint per run: count << 3 | code, code 0..3 for N, E, S, W;
+// a press is code 4 with the new color's number in place of the count. Uses result.moves,
+// or result.path when there are no moves.
+void generateMovesOutput(PuzzleMap const &map, SolveResult const &result, bool binary, std::ostream &out);
+void printNoSolutionOutput(PuzzleMap const &map, SolveResult const &result, std::ostream &out);
+
+#endif
@@ -0,0 +1,81 @@
+// Identifier: A8A3A33EF075ACEF9B08F5B9845569ECCB423725
+#ifndef PUZZLE_WORKER_POOL_H
+#define PUZZLE_WORKER_POOL_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs the same job on every worker (the calling thread is worker 0) and waits for all
+// of them. The other threads stay parked between jobs so a level costs two wakeups,
+// not thread creation.
+class WorkerPool {
+public:
+    explicit WorkerPool(unsigned size) : num_workers(size) {
+        for (unsigned worker = 1; worker < size; ++worker) {
+            threads.emplace_back([this, worker] { loop(worker); });
+        }
+    }
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stopping = true;
+        }
+        start.notify_all();
+        for (std::thread &t : threads) {
+            t.join();
+        }
+    }
+
+    unsigned size() const { return num_workers; }
+
+    void run(std::function<void(unsigned)> const &work) {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            job = &work;
+            pending = num_workers - 1;
+            ++generation;
+        }
+        start.notify_all();
+        work(0);
+        std::unique_lock<std::mutex> lock(m);
+        done.wait(lock, [this] { return pending == 0; });
+    }
+
+private:
+    void loop(unsigned worker) {
+        uint64_t seen = 0;
+        while (true) {
+            std::function<void(unsigned)> const *work = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(m);
+                start.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+                work = job;
+            }
+            (*work)(worker);
+            {
+                std::lock_guard<std::mutex> lock(m);
+                --pending;
+            }
+            done.notify_one();
+        }
+    }
+
+    unsigned num_workers;
+    std::vector<std::thread> threads;
+    std::mutex m;
+    std::condition_variable start, done;
+    std::function<void(unsigned)> const *job = nullptr;
+    uint64_t generation = 0;
+    unsigned pending = 0;
+    bool stopping = false;
+};
+
+#endif